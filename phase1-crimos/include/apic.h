@@ -0,0 +1,92 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Local APIC and IOAPIC Definitions
+ */
+#ifndef APIC_H
+#define APIC_H
+
+#define APIC_BASE_DEFAULT   0xfee00000  // Default local APIC MMIO address
+#define IOAPIC_BASE_DEFAULT 0xfec00000  // Default IOAPIC MMIO address
+
+// Interrupt command register delivery modes
+#define APIC_IPI_FIXED      0x4000      // Deliver the given vector
+#define APIC_IPI_INIT       0x4500      // INIT (assert)
+#define APIC_IPI_STARTUP    0x4600      // Startup IPI (vector = page number)
+
+#define IOAPIC_ISA_IRQS     16          // Number of ISA IRQs routed through the IOAPIC
+
+// IOAPIC input an ISA IRQ is wired to
+typedef struct ioapic_route_t {
+    int pin;                    // IOAPIC input pin
+    int active_low;             // Input is active low
+    int level;                  // Input is level triggered
+} ioapic_route_t;
+
+/**
+ * Detects and enables the local APIC and IOAPIC
+ * The legacy PIC must be masked by the caller
+ * @return 0 on success, -1 if the APIC is not available
+ */
+int apic_init(void);
+
+/**
+ * Enables the local APIC of an application processor
+ */
+void apic_ap_init(void);
+
+/**
+ * Sends an inter-processor interrupt
+ * @param apic_id - destination local APIC id
+ * @param icr - delivery mode and vector
+ */
+void apic_ipi(int apic_id, unsigned int icr);
+
+/**
+ * Indicates if the APIC has been enabled
+ * @return 1 if enabled, 0 if not enabled
+ */
+int apic_enabled(void);
+
+/**
+ * Returns the id of the local APIC of the running CPU
+ * @return local APIC id
+ */
+int apic_id(void);
+
+/**
+ * Signals the end of interrupt to the local APIC
+ */
+void apic_eoi(void);
+
+/**
+ * Routes an ISA IRQ through the IOAPIC to the given vector
+ * @param irq - IRQ vector (0x20 - 0x2f)
+ */
+void ioapic_irq_enable(int irq);
+
+/**
+ * Masks an ISA IRQ in the IOAPIC
+ * @param irq - IRQ vector (0x20 - 0x2f)
+ */
+void ioapic_irq_disable(int irq);
+
+/**
+ * Calibrates the local APIC timer against the time stamp counter
+ * @param tsc_per_tick - TSC cycles per timer tick
+ */
+void apic_timer_init(unsigned int tsc_per_tick);
+
+/**
+ * Starts the local APIC timer firing once every timer tick
+ */
+void apic_timer_periodic(void);
+
+/**
+ * Arms the local APIC timer to fire once after the given ticks
+ * @param ticks - number of timer ticks
+ */
+void apic_timer_oneshot(int ticks);
+
+#endif
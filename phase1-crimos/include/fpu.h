@@ -0,0 +1,39 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Lazy FPU/SSE Context Switching
+ */
+#ifndef FPU_H
+#define FPU_H
+
+#ifndef ASSEMBLER
+#include "kproc.h"
+#include "smp.h"
+
+/**
+ * Initializes FPU/SSE support on the bootstrap CPU
+ * Registers the device-not-available (#NM) handler
+ */
+void fpu_init(void);
+
+/**
+ * Enables the FPU/SSE on the running CPU
+ */
+void fpu_cpu_init(void);
+
+/**
+ * Prepares the FPU of the running CPU for the process about to run
+ * Sets CR0.TS unless the process already owns the FPU registers
+ * @param cpu - pointer to the running CPU entry
+ * @param proc - pointer to the process that will run
+ */
+void fpu_switch(cpu_t *cpu, proc_t *proc);
+
+/**
+ * Discards the FPU state of a process that is being destroyed
+ * @param proc - pointer to the process entry
+ */
+void fpu_release(proc_t *proc);
+#endif
+#endif
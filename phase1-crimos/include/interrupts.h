@@ -10,12 +10,42 @@
 #include <spede/machine/asmacros.h>
 
 // IRQ Definitions
+#define IRQ_NM       0x07       // Device not available exception
 #define IRQ_TIMER    0x20       // PIC IRQ 0 (Timer)
 #define IRQ_KEYBOARD 0x21       // PIC IRQ 1 (Keyboard)
+#define IRQ_COM1     0x24       // PIC IRQ 4 (COM1)
 #define IRQ_SYSCALL  0x80       // System call IRQ
+#define IRQ_RESCHED  0xee       // Reschedule inter-processor interrupt
+#define IRQ_SPURIOUS 0xef       // Local APIC spurious interrupt
+
+#define IRQ_MAX      0xf0       // Maximum number of ISR handlers
+
+// Handler duration histogram: one bucket per power of two (cycles)
+#define IRQ_STAT_BUCKETS    32
+
+#ifndef INTERRUPTS_APIC
+#define INTERRUPTS_APIC 0       // Boot default: 0 = 8259 PIC, 1 = APIC, -1 = APIC if the MP table lists an IOAPIC
+#endif
+
+#ifndef INTERRUPTS_NESTED
+#define INTERRUPTS_NESTED 1     // Let higher priority IRQs preempt handler bodies
+#endif
+
+#define IRQ_NEST_MAX        16      // Deepest interrupt nesting (one level per PIC priority)
+#define IRQ_STACK_SIZE      8192    // Per-CPU stack for nested interrupts
+#define IRQ_DEFER_MAX       8       // Work deferred by nested handlers, per CPU
+
+#ifndef PIC_AUTO_EOI
+#define PIC_AUTO_EOI    0       // Have the PIC dismiss interrupts when acknowledged
+#endif
 
 
 #ifndef ASSEMBLER
+#include "syscall_common.h"
+
+// Interrupt controller selected at boot (see INTERRUPTS_APIC)
+extern int interrupts_apic;
+
 /**
  * General interrupt enablement
  */
@@ -45,6 +75,57 @@ void interrupts_irq_register(int irq, void (*entry)(), void (*handler)());
  */
 void interrupts_irq_handler(int irq);
 
+/**
+ * Re-enables interrupts within the body of an IRQ handler so that IRQs
+ * of a higher priority can be handled before it completes
+ * The interrupt controller keeps the running IRQ and lower priority ones
+ * blocked until the handler is dismissed. The section must not touch
+ * anything a nested handler may change.
+ * @return 1 if interrupts were enabled, 0 if nesting is not possible here
+ */
+int interrupts_nest_begin(void);
+
+/**
+ * Disables interrupts again at the end of a nestable section
+ * Runs the work deferred by nested handlers once no section is open
+ * @param nested - value returned by interrupts_nest_begin
+ */
+void interrupts_nest_end(int nested);
+
+/**
+ * Defers work from a nested handler until the nestable sections on this
+ * CPU end. Nested handlers only save what the device gave them and defer
+ * the rest (waking processes, hotkeys), which may touch state the
+ * interrupted section is using
+ * @param func - function to run (queued once however often it is deferred)
+ * @return 0 on success, -1 if too much work is deferred
+ */
+int interrupts_defer(void (*func)(void));
+
+/**
+ * Records the end of the running CPU's interrupts-disabled window
+ * @param tsc - time stamp counter value when interrupts are re-enabled
+ */
+void interrupts_off_end(unsigned long long tsc);
+
+/**
+ * Obtains the statistics for an interrupt vector
+ * @param irq - IRQ number
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 if the vector is invalid or has no handler
+ */
+int interrupts_irq_stat(int irq, irq_stat_t *stat);
+
+/**
+ * Prints the statistics of every interrupt vector that has been handled
+ */
+void interrupts_dump(void);
+
+/**
+ * Initializes the PIC shadow masks, and auto-EOI mode if selected
+ */
+void pic_init(void);
+
 /**
  * Enables the specified IRQ in the PIC
  * @param irq - IRQ number
@@ -70,12 +151,21 @@ int pic_irq_enabled(int irq);
  */
 void pic_irq_dismiss(int irq);
 
+/**
+ * Masks every IRQ in both PICs
+ */
+void pic_disable(void);
+
 
 __BEGIN_DECLS
 
 extern void isr_entry_timer();
 extern void isr_entry_keyboard();
+extern void isr_entry_com1();
 extern void isr_entry_syscall();
+extern void isr_entry_spurious();
+extern void isr_entry_resched();
+extern void isr_entry_nm();
 
 __END_DECLS
 #endif
@@ -14,6 +14,8 @@
 #ifndef ASSEMBLER
 #include <spede/machine/asmacros.h>
 #include "kproc.h"
+#include "smp.h"
+#include "spinlock.h"
 
 #ifndef OS_NAME
 #define OS_NAME "MyOS"
@@ -30,8 +32,56 @@ typedef enum log_level {
     KERNEL_LOG_LEVEL_ALL    // Log everything!
 } log_level_t;
 
-// Global pointer to the current active process entry
-extern proc_t *active_proc;
+// Most verbose log level compiled in; messages above it cost nothing
+#ifndef KERNEL_LOG_LEVEL_BUILD
+#define KERNEL_LOG_LEVEL_BUILD KERNEL_LOG_LEVEL_TRACE
+#endif
+
+// Log message call site, one static instance per kernel_log_* call
+// Every instance is placed in the kernel_log_sites section so all call
+// sites are known at boot, whether or not they have logged
+typedef struct kernel_log_site_t {
+    const char *file;           // Source file
+    int line;                   // Source line
+    int level;                  // Log level
+    volatile int enabled;       // Messages from this call site are printed
+    unsigned int count;         // Messages logged
+} kernel_log_site_t;
+
+#define KERNEL_LOG_SITE_ATTR __attribute__((section("kernel_log_sites"), used, aligned(4)))
+
+// Current log level
+extern int kernel_log_level;
+
+// Queue kernel log messages for the kernel log process instead of
+// printing them from the caller
+#ifndef KERNEL_LOG_DEFERRED
+#define KERNEL_LOG_DEFERRED 1
+#endif
+
+// Send kernel log messages to the serial port (COM1) instead of the host
+// console when the UART driver is present
+#ifndef KERNEL_LOG_UART
+#define KERNEL_LOG_UART 0
+#endif
+
+#define KERNEL_LOG_RING_SIZE    128     // Queued messages (must be a power of two)
+#define KERNEL_LOG_MSG_LEN      120     // Longest queued message
+#define KERNEL_LOG_HISTORY_SIZE 64      // Printed messages kept (must be a power of two)
+
+// Queued kernel log message
+typedef struct kernel_log_record_t {
+    volatile unsigned int seq;  // Reservation number + 1 (queue) or sequence number
+                                // (history) once the record is complete
+    int level;                  // Log level
+    char msg[KERNEL_LOG_MSG_LEN];   // Formatted message
+} kernel_log_record_t;
+
+// Pointer to the active process entry of the running CPU
+#define active_proc (smp_cpu()->current)
+
+// Serializes kernel context execution across CPUs
+extern spinlock_t kernel_lock;
 
 /**
  * Kernel initialization
@@ -45,44 +95,96 @@ void kernel_init(void);
  */
 
 /**
- * Prints a kernel log message to the host with an error log level
+ * Prints a kernel log message for the given call site
+ * Use the kernel_log_* macros rather than calling this directly
  *
+ * @param site - pointer to the call site of the message
  * @param msg - string format for the message to be displayed
  * @param ... - variable arguments to pass in to the string format
  */
-void kernel_log_error(char *msg, ...);
+void kernel_log(kernel_log_site_t *site, char *msg, ...);
 
 /**
- * Prints a kernel log message to the host with a warning log level
+ * Logs a message at the given level
+ * Levels above KERNEL_LOG_LEVEL_BUILD are compiled out (the arguments are
+ * not evaluated). Otherwise the arguments are only evaluated when the
+ * runtime log level includes the message and its call site is enabled
  *
- * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * @param lvl - log level of the message
+ * @param ... - string format for the message, followed by its arguments
  */
-void kernel_log_warn(char *msg, ...);
+#define KERNEL_LOG(lvl, ...)                                                    \
+    do {                                                                        \
+        if ((lvl) <= KERNEL_LOG_LEVEL_BUILD && kernel_log_level >= (lvl)) {     \
+            static kernel_log_site_t kernel_log_site KERNEL_LOG_SITE_ATTR =    \
+                { __FILE__, __LINE__, (lvl), 1, 0 };                            \
+                                                                                \
+            if (kernel_log_site.enabled) {                                      \
+                kernel_log(&kernel_log_site, __VA_ARGS__);                      \
+            }                                                                   \
+        }                                                                       \
+    } while (0)
+
+// Prints a kernel log message to the host with an error log level
+#define kernel_log_error(...)   KERNEL_LOG(KERNEL_LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Prints a kernel log message to the host with a warning log level
+#define kernel_log_warn(...)    KERNEL_LOG(KERNEL_LOG_LEVEL_WARN, __VA_ARGS__)
+
+// Prints a kernel log message to the host with an info log level
+#define kernel_log_info(...)    KERNEL_LOG(KERNEL_LOG_LEVEL_INFO, __VA_ARGS__)
+
+// Prints a kernel log message to the host with a debug log level
+#define kernel_log_debug(...)   KERNEL_LOG(KERNEL_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Prints a kernel log message to the host with a trace log level
+#define kernel_log_trace(...)   KERNEL_LOG(KERNEL_LOG_LEVEL_TRACE, __VA_ARGS__)
 
 /**
- * Prints a kernel log message to the host with an info log level
- *
- * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * Enables or disables logging from a call site
+ * Call sites are numbered in link order; sites above the build log level
+ * are not numbered
+ * @param index - call site number, -1 for every call site
+ * @param enabled - 1 to enable, 0 to disable
+ * @return 0 on success, -1 if there is no such call site
  */
-void kernel_log_info(char *msg, ...);
+int kernel_log_site_enable(int index, int enabled);
 
 /**
- * Prints a kernel log message to the host with a debug log level
- *
- * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * Prints every call site compiled in, with its number, level,
+ * message count and whether it is enabled
  */
-void kernel_log_debug(char *msg, ...);
+void kernel_log_site_dump(void);
 
 /**
- * Prints a kernel log message to the host with a trace log level
- *
- * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * Copies kernel log messages from the log history, formatted as text lines
+ * ("<seq> <level>: <message>"), starting with the given sequence number
+ * @param seq - in: sequence number of the first message to read (0 for the
+ *              oldest message kept), out: sequence number to continue from
+ * @param buf - buffer to copy the messages to
+ * @param n - size of the buffer
+ * @return number of bytes copied
  */
-void kernel_log_trace(char *msg, ...);
+int kernel_log_read(unsigned int *seq, char *buf, int n);
+
+/**
+ * Prints the queued kernel log messages to the host console
+ * Run by the kernel log process; from its first call on, messages are
+ * queued instead of printed by the caller
+ */
+void kernel_log_drain(void);
+
+/**
+ * Blocks the active process until kernel log messages are queued
+ * Must be called from the kernel context
+ */
+void kernel_log_wait(void);
+
+/**
+ * Indicates if kernel log messages are waiting to be printed
+ * @return 1 if messages are queued, 0 otherwise
+ */
+int kernel_log_pending(void);
 
 /**
  * Triggers a kernel panic that does the following:
@@ -108,6 +210,12 @@ int kernel_get_log_level(void);
  */
 int kernel_set_log_level(int level);
 
+/**
+ * Returns the monotonic kernel clock
+ * @return nanoseconds since the kernel was initialized
+ */
+unsigned long long kernel_clock_ns(void);
+
 /**
  * Exits the kernel
  */
@@ -121,15 +229,65 @@ void kernel_exit(void);
  * process context must be saved. Any kernel processing (such as
  * interrupt handling) is performed before finally exiting the
  * kernel context to restore the proces state.
+ *
+ * If the interrupted process continues to run, this function returns
+ * so that context.S can take the fast path and restore only the
+ * registers the kernel may have changed.
  */
 void kernel_context_enter(trapframe_t *trapframe);
 
+/**
+ * Nested interrupt entry point
+ * Handles an interrupt taken while a handler on this CPU runs with
+ * interrupts enabled, then returns to the interrupted handler
+ * @param trapframe - pointer to the interrupted kernel state
+ */
+void kernel_context_nested(trapframe_t *trapframe);
+
+/**
+ * Releases the kernel lock and exits to the given process context
+ * @param trapframe - pointer to the trapframe to restore
+ */
+void kernel_context_leave(trapframe_t *trapframe);
+
+/**
+ * Resumes the active process of the CPU
+ * Switches to its kernel stack if it is blocked in the kernel, otherwise
+ * exits to its trapframe
+ * @param cpu - pointer to the running CPU entry
+ * @param save - where to save the kernel stack pointer of the caller,
+ *               NULL if the caller's stack is abandoned
+ */
+void kernel_dispatch(cpu_t *cpu, unsigned int *save);
+
+/**
+ * Runs the scheduler from within a kernel path
+ * If another process is selected, the kernel stack of the given process
+ * is saved and this function returns once it is scheduled again
+ * @param proc - process that owns the kernel stack in use
+ */
+void kernel_schedule(proc_t *proc);
+
+/**
+ * Kernel preemption point
+ * Lets other processes run if the active process' time slice has expired
+ */
+void kernel_preempt(void);
+
 /* The following functions are written directly in assembly */
 __BEGIN_DECLS
 /**
  * Exits the kernel context and restores the process context
  */
 extern void kernel_context_exit();
+
+/**
+ * Switches kernel stacks
+ * Saves the callee-saved registers and stack pointer to `save`, then
+ * resumes the kernel stack at `esp`, or leaves the kernel to `trapframe`
+ * through kernel_context_leave if `esp` is 0
+ */
+extern void kernel_switch(unsigned int *save, unsigned int esp, trapframe_t *trapframe);
 __END_DECLS
 
 #endif
@@ -12,13 +12,19 @@
 #include "queue.h"
 
 #ifndef PROC_MAX
-#define PROC_MAX        10   // maximum number of processes to support
+#define PROC_MAX        16   // maximum number of processes to support
 #endif
 
 #define PROC_IO_MAX     4    // Maximum process I/O buffers
 
+#ifndef KPROC_BENCH_MS
+#define KPROC_BENCH_MS  5000 // Duration of the scaling benchmark
+#endif
+
 #define PROC_NAME_LEN   32   // Maximum length of a process name
 #define PROC_STACK_SIZE 8192 // Process stack size
+#define PROC_KSTACK_SIZE 8192 // Process kernel stack size
+#define PROC_FPU_STATE_SIZE 512 // Size of the FXSAVE/FXRSTOR area
 
 // Process types
 typedef enum proc_type_t {
@@ -28,12 +34,20 @@ typedef enum proc_type_t {
 } proc_type_t;
 
 
+// Scheduling classes
+typedef enum sched_class_t {
+    SCHED_CLASS_FAIR,   // Weighted fair share (default)
+    SCHED_CLASS_EDF     // Earliest deadline first (runs ahead of fair processes)
+} sched_class_t;
+
+
 // Process States
 typedef enum state_t {
     NONE,               // Process has no state (doesn't exist)
     IDLE,               // Process is idle (not scheduled)
     ACTIVE,             // Process is active (scheduled)
-    SLEEPING            // Process is sleeping (not scheduled)
+    SLEEPING,           // Process is sleeping (not scheduled)
+    BLOCKED             // Process is waiting for an event (not scheduled)
 } state_t;
 
 
@@ -51,12 +65,43 @@ typedef struct proc_t {
     int cpu_time;                   // Current CPU time the process has used
     int sleep_time;                 // Time that a process should be sleeping
 
-    queue_t *scheduler_queue;       // Pointer to the queue where the process resides
+    struct cpu_t *run_cpu;          // CPU whose run queue holds the process (NULL if not queued)
+    int run_index;                  // Position in that run queue
+
+    int nice;                       // Nice value (-20 highest to 19 lowest priority)
+    unsigned int weight;            // Scheduling weight derived from the nice value
+    unsigned int vruntime;          // Weighted virtual runtime
+    int slice;                      // Time slice (ticks) granted when last scheduled
+    int mlfq_level;                 // MLFQ priority level (0 is highest)
+    unsigned int mlfq_seq;          // MLFQ enqueue order within a level
+
+    sched_class_t sched_class;      // Scheduling class
+    int rt_cpu;                     // CPU the real-time process was admitted on
+    int rt_period;                  // Real-time period (ticks)
+    int rt_budget;                  // Real-time budget per period (ticks)
+    int rt_relative;                // Real-time relative deadline (ticks)
+    int rt_release;                 // Release time of the current job
+    int rt_deadline;                // Absolute deadline of the current job
+    int rt_remaining;               // Budget left for the current job
+    unsigned int rt_misses;         // Number of deadlines missed
+
+    unsigned long long user_cycles;     // TSC cycles spent running the process
+    unsigned long long kernel_cycles;   // TSC cycles spent in the kernel context on its behalf
+    unsigned int switches_voluntary;    // Times it gave up the CPU (sleep, block, exit, yield)
+    unsigned int switches_involuntary;  // Times it was preempted while runnable
+    unsigned int wakeups;               // Times it woke up from sleeping or blocking
 
     ringbuf_t *io[PROC_IO_MAX];     // Process input/output buffers
 
     unsigned char *stack;           // Pointer to the process stack
     trapframe_t *trapframe;         // Pointer to the trapframe
+
+    unsigned char *kstack;          // Pointer to the process kernel stack
+    unsigned int kesp;              // Saved kernel stack pointer (0 unless blocked in the kernel)
+    void *wait_chan;                // Event the process is blocked on
+
+    int fpu_used;                   // Process has used the FPU/SSE
+    unsigned char fpu_state[PROC_FPU_STATE_SIZE] __attribute__((aligned(16))); // Saved FPU/SSE state
 } proc_t;
 
 
@@ -84,6 +129,8 @@ int kproc_create(void *proc_ptr, char *proc_name, proc_type_t proc_type);
 /**
  * Destroys a process
  * If the process is currently scheduled it must be unscheduled
+ * The entry of a process that a CPU is running (or whose kernel stack
+ * it is using) is destroyed once that CPU switches to another process
  * @param proc - process entry
  * @return 0 on success, -1 on error
  */
@@ -105,8 +152,41 @@ proc_t *entry_to_proc(int entry);
 
 void kproc_attach(int pid, int driver, int id);
 
+/**
+ * Blocks the active process until kproc_wakeup is called for the event
+ * Must be called from the kernel context; returns once woken
+ * @param chan - address identifying the event
+ */
+void kproc_block(void *chan);
+
+/**
+ * Wakes up every process blocked on the given event
+ * @param chan - address identifying the event
+ */
+void kproc_wakeup(void *chan);
+
+/**
+ * Idle process
+ */
+void kproc_idle(void);
+
+/**
+ * Kernel log process
+ * Prints the queued kernel log messages at the lowest priority
+ */
+void kproc_log(void);
+
 /**
  * Test process
  */
 void kproc_test(void);
+
+/**
+ * Runs the scaling benchmark
+ * Starts CPU-bound test processes and measures the aggregate CPU time
+ * they receive over KPROC_BENCH_MS
+ * @param count - number of test processes to start
+ * @return 0 on success, -1 on error
+ */
+int kproc_bench(int count);
 #endif
@@ -9,6 +9,10 @@
 
 #include "syscall_common.h"
 
+#ifndef KSYSCALL_IO_CHUNK
+#define KSYSCALL_IO_CHUNK 256   // Bytes copied between kernel preemption points
+#endif
+
 /**
  * System Call Initialization
  */
@@ -45,6 +49,13 @@ int ksyscall_io_flush(int io);
  */
 int ksyscall_sys_get_time(void);
 
+/**
+ * Gets the current system time (in nanoseconds)
+ * @param ns - pointer to where the time will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int ksyscall_sys_get_time_ns(unsigned long long *ns);
+
 /**
  * Gets the operating system name
  * @param name - pointer to a character buffer where the name will be copied
@@ -52,12 +63,83 @@ int ksyscall_sys_get_time(void);
  */
 int ksyscall_sys_get_name(char *name);
 
+/**
+ * Gets the keystroke-to-echo latency statistics
+ * @param stat - pointer to the structure where the statistics will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int ksyscall_sys_get_latency(latency_stat_t *stat);
+
+/**
+ * Gets the system load summary
+ * @param load - pointer to the structure where the summary will be copied
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_sys_get_load(sys_load_t *load);
+
+/**
+ * Enables or disables a kernel log call site, or lists the call sites
+ * on the host console
+ * @param index - call site number, -1 for every call site
+ * @param enabled - 1 to enable, 0 to disable, -1 to list the call sites
+ * @return 0 on success, -1 if there is no such call site
+ */
+int ksyscall_sys_log_site(int index, int enabled);
+
+/**
+ * Reads kernel log messages, formatted as text lines ("<seq> <level>: <message>")
+ * Pass the sequence number back in to continue where the last read ended
+ * @param seq - in: sequence number of the first message to read (0 for the
+ *              oldest message kept), out: sequence number to continue from
+ * @param buf - buffer to copy the messages to
+ * @param n - size of the buffer
+ * @return number of bytes copied, -1 on error
+ */
+int ksyscall_sys_log_read(unsigned int *seq, char *buf, int n);
+
+/**
+ * Obtains the statistics for an interrupt vector
+ * @param irq - interrupt vector
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 if the vector is invalid or has no handler
+ */
+int ksyscall_sys_irq_stat(int irq, irq_stat_t *stat);
+
+/**
+ * Blocks the active process until kernel log messages are queued
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_sys_log_wait(void);
+
 /**
  * Puts the current process to sleep for the specified number of seconds
  * @param seconds - number of seconds the process should sleep
  */
 int ksyscall_proc_sleep(int seconds);
 
+/**
+ * Puts the active process to sleep for the specified number of nanoseconds
+ * @param ns - number of nanoseconds the process should sleep
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_proc_sleep_ns(unsigned long long ns);
+
+/**
+ * Puts the active process to sleep until the kernel clock reaches the
+ * specified time
+ * @param ns - kernel clock time (see sys_get_time_ns) to sleep until
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_proc_sleep_until(unsigned long long ns);
+
+/**
+ * Copies the accounting statistics of a process
+ * @param pid - process id
+ * @param stat - pointer to the statistics to fill in
+ * @return 0 on success, -1 if there is no such process
+ */
+int ksyscall_proc_stat(int pid, proc_stat_t *stat);
+
 /**
  * Exits the current process
  */
@@ -76,6 +158,42 @@ int ksyscall_proc_get_pid(void);
  */
 int ksyscall_proc_get_name(char *name);
 
+/**
+ * Sets the active process' nice value
+ * @param nice - nice value (-20 highest to 19 lowest priority)
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int ksyscall_proc_set_nice(int nice);
+
+/**
+ * Makes the active process a periodic real-time (EDF) process
+ * @param period_ms - period in milliseconds, 0 to return to the fair class
+ * @param budget_ms - execution budget per period in milliseconds
+ * @param deadline_ms - relative deadline in milliseconds, 0 to use the period
+ * @return 0 on success, -1 if the parameters are invalid or admission fails
+ */
+int ksyscall_proc_set_edf(int period_ms, int budget_ms, int deadline_ms);
+
+/**
+ * Ends the current job of the active real-time process
+ * @return 0 on success, -1 if the process is not a real-time process
+ */
+int ksyscall_proc_edf_wait(void);
+
+/**
+ * Gives up the rest of the active process' time slice
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_proc_yield(void);
+
+/**
+ * Gives the rest of the active process' time slice to another process
+ * If the target is not waiting to run, this is the same as a plain yield
+ * @param pid - process id of the process to donate to
+ * @return 0 on success, -1 if there is no such process
+ */
+int ksyscall_proc_yield_to(int pid);
+
 
 #endif
 
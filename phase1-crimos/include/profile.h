@@ -0,0 +1,47 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Sampling Profiler
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "kproc.h"
+
+// Build the sampling profiler (started and stopped with CTRL+P)
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
+#define PROFILE_SIZE    1024    // Histogram entries (must be a power of two)
+
+// Histogram entry: number of samples taken at an instruction
+typedef struct profile_entry_t {
+    unsigned int eip;           // Sampled instruction pointer
+    short pid;                  // Process that was running
+    unsigned char kernel;       // Process was a kernel process
+    unsigned char used;         // Entry is in use
+    unsigned int count;         // Number of samples
+} profile_entry_t;
+
+/**
+ * Records a sample of the process interrupted by the timer
+ * @param proc - pointer to the interrupted process entry
+ */
+void profile_sample(proc_t *proc);
+
+/**
+ * Starts the profiler with an empty histogram, or stops it and prints the
+ * histogram to the host console if it is running
+ */
+void profile_toggle(void);
+
+/**
+ * Prints the histogram to the host console
+ * One line per entry: "P <eip> <pid> <K|U> <count>"; the addresses can be
+ * looked up in the disassembly generated by `make text`
+ */
+void profile_dump(void);
+
+#endif
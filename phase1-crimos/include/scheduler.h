@@ -9,17 +9,123 @@
 #define SCHEDULER_H
 
 #include "kproc.h"
+#include "syscall_common.h"
+#include "timer.h"
 
-#ifndef SCHEDULER_TIMESLICE
-#define SCHEDULER_TIMESLICE 10
+// Period in which every runnable process should run once; each process
+// receives a share of it proportional to its weight
+#ifndef SCHEDULER_LATENCY
+#define SCHEDULER_LATENCY TIMER_MS_TO_TICKS(100)
 #endif
 
+// Shortest time slice given to a process
+#ifndef SCHEDULER_MIN_GRANULARITY
+#define SCHEDULER_MIN_GRANULARITY TIMER_MS_TO_TICKS(10)
+#endif
+
+// Largest real-time utilization admitted on a CPU (permille); the rest
+// is left to fair processes
+#ifndef SCHEDULER_EDF_UTIL_MAX
+#define SCHEDULER_EDF_UTIL_MAX 900
+#endif
+
+// Schedule fair-class processes with a multi-level feedback queue instead
+// of by virtual runtime
+#ifndef SCHEDULER_MLFQ
+#define SCHEDULER_MLFQ 0
+#endif
+
+#define SCHEDULER_MLFQ_LEVELS   4   // Number of MLFQ priority levels
+
+// Time slice at each MLFQ level; doubles with every level
+#define SCHEDULER_MLFQ_SLICE(level) (TIMER_MS_TO_TICKS(20) << (level))
+
+// Interval at which every process is returned to the top MLFQ level
+#ifndef SCHEDULER_MLFQ_BOOST_MS
+#define SCHEDULER_MLFQ_BOOST_MS 1000
+#endif
+
+#define SCHEDULER_NICE_MIN  -20     // Highest priority nice value
+#define SCHEDULER_NICE_MAX  19      // Lowest priority nice value
+
 
 /**
  * Initializes the scheduler, data structures, etc.
  */
 void scheduler_init(void);
 
+/**
+ * Scheduler timer callback
+ * Charges a tick to the active process of the running CPU
+ */
+void scheduler_timer(void);
+
+/**
+ * Load average timer callback
+ * Samples the number of runnable processes and idle CPUs
+ */
+void scheduler_load_sample(void);
+
+/**
+ * Gets the system load summary
+ * (1/5/15 second load averages, run queue depth, idle time, process entries)
+ * @param load - pointer to the summary to fill in
+ * @return 0 on success, -1 on error
+ */
+int scheduler_load_get(sys_load_t *load);
+
+/**
+ * MLFQ priority boost timer callback
+ * Returns every process to the top MLFQ level
+ */
+void scheduler_mlfq_boost(void);
+
+/**
+ * Indicates if the process is the idle process of any CPU
+ * @param proc - pointer to the process entry
+ * @return 1 if it is an idle process, 0 otherwise
+ */
+int scheduler_is_idle(proc_t *proc);
+
+/**
+ * Sets the nice value (and scheduling weight) of a process
+ * @param proc - pointer to the process entry
+ * @param nice - nice value (SCHEDULER_NICE_MIN to SCHEDULER_NICE_MAX)
+ * @return 0 on success, -1 on error
+ */
+int scheduler_set_nice(proc_t *proc, int nice);
+
+/**
+ * Places a process in the real-time (EDF) class, or returns it to the
+ * fair class when period is 0
+ * @param proc - pointer to the process entry
+ * @param period - period (ticks)
+ * @param budget - execution budget per period (ticks)
+ * @param deadline - relative deadline (ticks), 0 to use the period
+ * @return 0 on success, -1 if the parameters are invalid or admission fails
+ */
+int scheduler_set_edf(proc_t *proc, int period, int budget, int deadline);
+
+/**
+ * Ends the current job of a real-time process
+ * The process sleeps until its next release
+ * @param proc - pointer to the process entry
+ */
+void scheduler_edf_complete(proc_t *proc);
+
+/**
+ * Gives up the rest of the time slice of the running process
+ * @param proc - pointer to the yielding (active) process entry
+ * @param target - pointer to the process to donate the rest of the
+ *                 time slice to, NULL for none
+ */
+void scheduler_yield(proc_t *proc, proc_t *target);
+
+/**
+ * Prints the load statistics of every CPU to the kernel log
+ */
+void scheduler_cpu_dump(void);
+
 /**
  * Executes the scheduler
  * Should ensure that `active_proc` is set to a valid process entry
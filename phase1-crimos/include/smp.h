@@ -0,0 +1,138 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Symmetric Multiprocessing
+ */
+#ifndef SMP_H
+#define SMP_H
+
+#ifndef CPU_MAX
+#define CPU_MAX             4           // Maximum number of CPUs to support
+#endif
+
+#define SMP_TRAMPOLINE_ADDR 0x8000      // Real mode AP startup code (page aligned, < 1MB)
+
+#ifndef ASSEMBLER
+#include "apic.h"
+#include "kproc.h"
+#include "scheduler.h"
+
+// Run queue kept as a binary min-heap
+typedef struct run_heap_t {
+    proc_t *procs[PROC_MAX];    // Queued processes
+    int count;                  // Number of queued processes
+} run_heap_t;
+
+// Per-CPU data
+typedef struct cpu_t {
+    int id;                     // CPU index (matches the local APIC id)
+    volatile int started;       // CPU is running and can schedule processes
+
+    proc_t *current;            // Process running on this CPU
+    proc_t *idle;               // Idle process for this CPU
+    proc_t *exited;             // Process destroyed while this CPU was using it (reaped by kernel_dispatch)
+
+    // Processes that will be scheduled on this CPU
+    run_heap_t edf;             // Real-time class run queue (ordered by deadline)
+    run_heap_t fair;            // Fair class run queue (ordered by vruntime)
+    int run_count;              // Number of queued processes (all classes)
+    unsigned int run_weight;    // Total weight of the queued fair processes
+    unsigned int min_vruntime;  // Lower bound of the vruntime on this CPU (only increases)
+    int resched;                // Preempt the current process at the next scheduler run
+    proc_t *yield_to;           // Process that runs next with a donated time slice
+    int yield_slice;            // Time slice (ticks) donated to yield_to
+    int yielded;                // The current process gave up the rest of its time slice
+    int out_pid;                // Process that gave up the CPU since the last scheduler run (-1 if none)
+    int out_state;              // State it gave up the CPU in
+
+    // MLFQ statistics, per level
+    int mlfq_depth[SCHEDULER_MLFQ_LEVELS];          // Processes queued
+    int mlfq_depth_max[SCHEDULER_MLFQ_LEVELS];      // Most processes queued at once
+    unsigned int mlfq_runs[SCHEDULER_MLFQ_LEVELS];  // Processes scheduled
+
+    unsigned int edf_util;      // Admitted real-time utilization (permille)
+    unsigned int edf_misses;    // Real-time deadline misses
+
+    proc_t *acct_proc;          // Process charged for the cycles since acct_tsc
+    unsigned long long acct_tsc;    // TSC at the last kernel entry or exit
+
+    unsigned long long irq_off_tsc; // TSC when interrupts were disabled to enter the kernel
+    unsigned int irq_off_max;       // Longest interrupts-disabled window (cycles)
+
+    int irq_current;            // Vector being handled (-1 if none)
+    int irq_depth;              // Nested interrupts being handled
+    int irq_depth_max;          // Deepest interrupt nesting seen
+    unsigned int irq_nested;    // Interrupts taken while a handler was running
+
+    proc_t *fpu_owner;          // Process whose state is in the FPU registers
+    int fpu_ts;                 // CR0.TS is set
+
+    // Load statistics
+    unsigned int busy_ticks;    // Ticks spent running a process
+    unsigned int idle_ticks;    // Ticks spent running the idle process
+    unsigned int switches;      // Number of processes scheduled
+    unsigned int steals;        // Processes taken from another CPU's run queue
+    unsigned int stolen;        // Processes taken from this CPU's run queue
+    unsigned int exit_fast;     // Kernel exits resuming the interrupted process
+    unsigned int exit_full;     // Kernel exits switching to another process
+} cpu_t;
+
+/**
+ * Returns the per-CPU data of the running CPU
+ * @return pointer to the CPU entry
+ */
+cpu_t *smp_cpu(void);
+
+/**
+ * Returns the per-CPU data for the given CPU
+ * @param id - CPU index
+ * @return pointer to the CPU entry, NULL if out of range
+ */
+cpu_t *smp_get_cpu(int id);
+
+/**
+ * Returns the number of CPUs that have been started
+ * @return number of CPUs
+ */
+int smp_get_cpu_count(void);
+
+/**
+ * Asks another CPU to run its scheduler
+ * @param cpu - pointer to the CPU entry
+ */
+void smp_resched(cpu_t *cpu);
+
+/**
+ * Reads the IOAPIC and the ISA interrupt routing from the MP configuration
+ * table. ISA IRQs the table does not mention keep their own pin, edge
+ * triggered and active high; overrides such as the PIT on pin 2 apply
+ * @param route - ISA IRQ routes to fill in (IOAPIC_ISA_IRQS entries), may be NULL
+ * @return MMIO address of the first usable IOAPIC, 0 if the table lists none
+ */
+unsigned int smp_mp_ioapic(ioapic_route_t *route);
+
+/**
+ * Starts all application processors
+ * Each started CPU receives its own idle process
+ */
+void smp_init(void);
+
+/**
+ * Application processor entry point (called from the startup trampoline)
+ */
+void smp_ap_main(void);
+
+// Kernel stack used on interrupt entry, indexed by CPU (see context.S)
+extern unsigned char *smp_kstack_top[CPU_MAX];
+
+// Open nestable sections (interrupts_nest_begin), indexed by CPU (see context.S)
+extern volatile int smp_irq_depth[CPU_MAX];
+
+/* The startup trampoline is written directly in assembly */
+extern char smp_trampoline_start[];
+extern char smp_trampoline_stack[];
+extern char smp_trampoline_gdtr[];
+extern char smp_trampoline_end[];
+#endif
+#endif
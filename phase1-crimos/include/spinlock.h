@@ -0,0 +1,35 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Spinlocks
+ */
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+typedef struct spinlock_t {
+    volatile int locked;        // 1 when held, 0 when free
+} spinlock_t;
+
+/**
+ * Acquires a spinlock, spinning until it becomes available
+ * @param lock - pointer to the spinlock
+ */
+static inline void spin_lock(spinlock_t *lock) {
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        // Spin on a plain read so the cache line is not bounced
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+}
+
+/**
+ * Releases a spinlock
+ * @param lock - pointer to the spinlock
+ */
+static inline void spin_unlock(spinlock_t *lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+#endif
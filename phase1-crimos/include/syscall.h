@@ -15,6 +15,13 @@
  */
 int sys_get_time(void);
 
+/**
+ * Gets the current system time (in nanoseconds)
+ * @param ns - pointer to where the time will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int sys_get_time_ns(unsigned long long *ns);
+
 /**
  * Gets the operating system name
  * @param name - pointer to a character buffer where the name will be copied
@@ -22,6 +29,56 @@ int sys_get_time(void);
  */
 int sys_get_name(char *name);
 
+/**
+ * Gets the keystroke-to-echo latency statistics
+ * @param stat - pointer to the structure where the statistics will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int sys_get_latency(latency_stat_t *stat);
+
+/**
+ * Gets the system load summary
+ * (1/5/15 second load averages, run queue depth, idle time, process entries)
+ * @param load - pointer to the structure where the summary will be copied
+ * @return 0 on success, -1 on error
+ */
+int sys_get_load(sys_load_t *load);
+
+/**
+ * Enables or disables a kernel log call site, or lists the call sites
+ * on the host console
+ * @param index - call site number, -1 for every call site
+ * @param enabled - 1 to enable, 0 to disable, -1 to list the call sites
+ * @return 0 on success, -1 if there is no such call site
+ */
+int sys_log_site(int index, int enabled);
+
+/**
+ * Reads kernel log messages, formatted as text lines ("<seq> <level>: <message>")
+ * Pass the sequence number back in to continue where the last read ended
+ * @param seq - in: sequence number of the first message to read (0 for the
+ *              oldest message kept), out: sequence number to continue from
+ * @param buf - buffer to copy the messages to
+ * @param n - size of the buffer
+ * @return number of bytes copied, -1 on error
+ */
+int sys_log_read(unsigned int *seq, char *buf, int n);
+
+/**
+ * Obtains the statistics for an interrupt vector
+ * @param irq - interrupt vector
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 if the vector is invalid or has no handler
+ */
+int sys_irq_stat(int irq, irq_stat_t *stat);
+
+/**
+ * Waits until kernel log messages are queued for printing
+ * Used by the kernel log process
+ * @return 0 on success, -1 on error
+ */
+int sys_log_wait(void);
+
 /**
  * Gets the current process' id
  * @return process id
@@ -41,12 +98,77 @@ int proc_get_name(char *name);
  */
 void proc_sleep(int seconds);
 
+/**
+ * Puts the current process to sleep for the specified number of milliseconds
+ * @param ms - number of milliseconds the process should sleep
+ * @return 0 on success, -1 on error
+ */
+int proc_sleep_ms(int ms);
+
+/**
+ * Puts the current process to sleep for the specified number of nanoseconds
+ * @param ns - number of nanoseconds the process should sleep
+ * @return 0 on success, -1 on error
+ */
+int proc_sleep_ns(unsigned long long ns);
+
+/**
+ * Puts the current process to sleep until the system time reaches the
+ * specified time
+ * @param ns - system time in nanoseconds (see sys_get_time_ns)
+ * @return 0 on success, -1 on error
+ */
+int proc_sleep_until(unsigned long long ns);
+
+/**
+ * Gets the accounting statistics of a process
+ * @param pid - process id
+ * @param stat - pointer to the statistics to fill in
+ * @return 0 on success, -1 if there is no such process
+ */
+int proc_stat(int pid, proc_stat_t *stat);
+
 /**
  * Exits the current process
  * @param exitcode An exit code to return to the parent process
  */
 void proc_exit(int exitcode);
 
+/**
+ * Sets the current process' nice value
+ * @param nice - nice value (-20 highest to 19 lowest priority)
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int proc_set_nice(int nice);
+
+/**
+ * Makes the current process a periodic real-time (EDF) process
+ * @param period_ms - period in milliseconds, 0 to return to the fair class
+ * @param budget_ms - execution budget per period in milliseconds
+ * @param deadline_ms - relative deadline in milliseconds, 0 to use the period
+ * @return 0 on success, -1 if the parameters are invalid or admission fails
+ */
+int proc_set_edf(int period_ms, int budget_ms, int deadline_ms);
+
+/**
+ * Ends the current job of a real-time process
+ * Sleeps until the start of the next period
+ */
+void proc_edf_wait(void);
+
+/**
+ * Gives up the rest of the current process' time slice
+ * Other waiting processes run before the process is scheduled again
+ */
+void proc_yield(void);
+
+/**
+ * Gives the rest of the current process' time slice to another process
+ * @param pid - process id of the process to donate to
+ * @return 0 on success, -1 if there is no such process
+ */
+int proc_yield_to(int pid);
+
 /**
  * Writes up to n bytes to the process' specified IO buffer
  * @param io - the IO buffer to write to
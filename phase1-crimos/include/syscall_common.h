@@ -21,8 +21,65 @@ typedef enum {
     SYSCALL_PROC_SLEEP,
     SYSCALL_PROC_EXIT,
     SYSCALL_PROC_GET_PID,
-    SYSCALL_PROC_GET_NAME
+    SYSCALL_PROC_GET_NAME,
+    SYSCALL_SYS_GET_LATENCY,
+    SYSCALL_SYS_GET_TIME_NS,
+    SYSCALL_PROC_SET_NICE,
+    SYSCALL_PROC_SET_EDF,
+    SYSCALL_PROC_EDF_WAIT,
+    SYSCALL_PROC_YIELD,
+    SYSCALL_PROC_YIELD_TO,
+    SYSCALL_PROC_SLEEP_NS,
+    SYSCALL_PROC_SLEEP_UNTIL,
+    SYSCALL_PROC_STAT,
+    SYSCALL_SYS_GET_LOAD,
+    SYSCALL_SYS_LOG_SITE,
+    SYSCALL_SYS_LOG_READ,
+    SYSCALL_SYS_IRQ_STAT,
+    SYSCALL_SYS_LOG_WAIT
 } syscall_t;
 
+// Keystroke-to-echo latency summary (in CPU cycles)
+typedef struct latency_stat_t {
+    unsigned int count;         // Number of keystrokes measured
+    unsigned int p50;           // 50th percentile latency
+    unsigned int p99;           // 99th percentile latency
+    unsigned int max;           // Maximum latency
+} latency_stat_t;
+
+// System load summary
+typedef struct sys_load_t {
+    unsigned int load[3];       // 1, 5 and 15 second load averages (x100)
+    int run_queue;              // Processes waiting to run (all CPUs)
+    int run_queue_max;          // Most processes waiting to run at once
+    unsigned int idle_pct;      // Idle CPU time, decayed over 1 second (percent)
+    int cpus;                   // Number of CPUs running
+    int procs;                  // Process entries in use
+    int procs_max;              // Process entries available (PROC_MAX)
+} sys_load_t;
+
+// Process accounting summary
+typedef struct proc_stat_t {
+    int pid;                            // Process id
+    int run_ticks;                      // Timer ticks charged to the process
+    unsigned long long user_cycles;     // TSC cycles spent running the process
+    unsigned long long kernel_cycles;   // TSC cycles spent in the kernel on its behalf
+    unsigned int user_us;               // user_cycles in microseconds
+    unsigned int kernel_us;             // kernel_cycles in microseconds
+    unsigned int switches_voluntary;    // Times it gave up the CPU (sleep, block, exit, yield)
+    unsigned int switches_involuntary;  // Times it was preempted while runnable
+    unsigned int wakeups;               // Times it woke up from sleeping or blocking
+} proc_stat_t;
+
+// Interrupt vector summary
+typedef struct irq_stat_t {
+    int irq;                    // Interrupt vector
+    unsigned int count;         // Interrupts handled (all CPUs)
+    unsigned int avg_ns;        // Average handler duration
+    unsigned int p99_ns;        // 99th percentile handler duration
+    unsigned int max_ns;        // Longest handler duration
+    unsigned int off_max_ns;    // Longest interrupts-disabled window (any vector, all CPUs)
+} irq_stat_t;
+
 #endif
 
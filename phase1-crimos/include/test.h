@@ -12,6 +12,7 @@
 #include "vga.h"
 #include "tty.h"
 #include "kproc.h"
+#include "scheduler.h"
 
 /**
  * Displays a "spinner" to show activity at the top-right corner of the
@@ -31,7 +32,7 @@ void test_spinner(void) {
  */
 void test_timer(void) {
     vga_set_xy(73, 0);
-    vga_printf("%5d", timer_get_ticks() / 100);
+    vga_printf("%5d", TIMER_TICKS_TO_SEC(timer_get_ticks()));
 }
 
 /**
@@ -48,8 +49,8 @@ void test_proc_list(void) {
         return;
     }
 
-    // Periodically clear the screen to handle processes exiting
-    if ((timer_get_ticks() % 100) == 0) {
+    // Clear the screen once per second to handle processes exiting
+    if ((timer_get_ticks() % TIMER_HZ) == 0) {
         for (int r = 1; r < VGA_HEIGHT; r++) {
             for (int c = 0; c < VGA_WIDTH; c++) {
                 vga_putc_at(c, r, bg_color, fg_color, ' ');
@@ -90,6 +91,11 @@ void test_proc_list(void) {
                 fg_color = VGA_COLOR_YELLOW;
                 break;
 
+            case BLOCKED:
+                state = 'B';
+                fg_color = VGA_COLOR_YELLOW;
+                break;
+
             default:
                 state = '?';
                 break;
@@ -103,6 +109,18 @@ void test_proc_list(void) {
         row++;
     }
 
+    // System load on the bottom row
+    sys_load_t load;
+
+    if (scheduler_load_get(&load) == 0) {
+        snprintf(buf, VGA_WIDTH, "Load %u.%02u %u.%02u %u.%02u  Queue %d (max %d)  Idle %u%%  Procs %d/%d",
+                 load.load[0] / 100, load.load[0] % 100,
+                 load.load[1] / 100, load.load[1] % 100,
+                 load.load[2] / 100, load.load[2] % 100,
+                 load.run_queue, load.run_queue_max, load.idle_pct,
+                 load.procs, load.procs_max);
+        vga_puts_at(0, VGA_HEIGHT - 1, VGA_COLOR_BLACK, VGA_COLOR_LIGHT_GREY, buf);
+    }
 }
 
 /**
@@ -112,13 +130,13 @@ void test_init(void) {
     kernel_log_info("Initializing test functions");
 
     // Register the spinner to update at a rate of 10 times per second
-    timer_callback_register(&test_spinner, 10, -1);
+    timer_callback_register(&test_spinner, TIMER_MS_TO_TICKS(100), -1);
 
     // Register the timer to update at a rate of 4 times per second
-    timer_callback_register(&test_timer, 25, -1);
+    timer_callback_register(&test_timer, TIMER_MS_TO_TICKS(250), -1);
 
     // Register the process list to update at a rate of 10 times per second
-    timer_callback_register(&test_proc_list, 10, -1);
+    timer_callback_register(&test_proc_list, TIMER_MS_TO_TICKS(100), -1);
 }
 
 #endif
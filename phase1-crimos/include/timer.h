@@ -11,6 +11,23 @@
 #define TIMERS_MAX 32
 #endif
 
+#ifndef TIMER_HZ
+#define TIMER_HZ 100        // Timer interrupt frequency (ticks per second)
+#endif
+
+#ifndef TIMER_TICKLESS
+#define TIMER_TICKLESS 1    // Stop the periodic tick while the CPU is idle
+#endif
+
+// Converts milliseconds to timer ticks (rounded up, at least one tick)
+#define TIMER_MS_TO_TICKS(ms)   (((ms) * TIMER_HZ + 999) / 1000)
+
+// Length of a timer tick in nanoseconds
+#define TIMER_NS_PER_TICK       (1000000000 / TIMER_HZ)
+
+// Converts timer ticks to whole seconds
+#define TIMER_TICKS_TO_SEC(t)   ((t) / TIMER_HZ)
+
 /**
  * Registers a new callback to be called at the specified interval
  * @param func_ptr - function pointer to be called
@@ -29,6 +46,16 @@ int timer_callback_register(void (*func_ptr)(), int interval, int repeat);
  */
 int timer_callback_unregister(int id);
 
+/**
+ * Lets a callback wait while the CPU is idle
+ * The tickless idle does not wake up for it; it runs when the ticks
+ * skipped while idle are replayed
+ * @param id - timer id (as returned by timer_callback_register)
+ *
+ * @return 0 on success, -1 on error
+ */
+int timer_callback_defer(int id);
+
 /**
  * Returns the number of ticks that have occurred since startup
  *
@@ -36,6 +63,54 @@ int timer_callback_unregister(int id);
  */
 int timer_get_ticks(void);
 
+/**
+ * Returns the calibrated time stamp counter frequency
+ *
+ * @return TSC frequency in kHz, 0 if not calibrated
+ */
+unsigned int timer_get_tsc_khz(void);
+
+/**
+ * Converts a kernel clock time to the first timer tick at or after it
+ *
+ * @param ns - absolute kernel clock time in nanoseconds (see kernel_clock_ns)
+ * @return tick count (as returned by timer_get_ticks)
+ */
+int timer_ns_to_tick(unsigned long long ns);
+
+/**
+ * Converts a number of TSC cycles to nanoseconds
+ * @param cycles - number of CPU cycles
+ *
+ * @return nanoseconds
+ */
+unsigned long long timer_cycles_to_ns(unsigned long long cycles);
+
+/**
+ * Stops the periodic tick until the next deadline
+ *
+ * Reprograms the PIT in one-shot mode to fire when the next timer
+ * callback or the given deadline is due, whichever is sooner.
+ * Deferrable callbacks (such as the per-tick accounting) do not count;
+ * they run when timer_tickless_exit replays the skipped ticks.
+ * @param ticks - ticks until the next wakeup deadline (-1 for none)
+ */
+void timer_tickless_enter(int ticks);
+
+/**
+ * Restores the periodic tick after a tickless period
+ *
+ * Accounts for the ticks that elapsed while the periodic tick was
+ * stopped. Must be called on every kernel entry.
+ * @param irq - the interrupt that caused the kernel entry
+ */
+void timer_tickless_exit(int irq);
+
+/**
+ * Prints how often the periodic tick was stopped while idle
+ */
+void timer_dump(void);
+
 /**
  * Initializes timer related data structures and variables
  */
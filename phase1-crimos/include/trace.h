@@ -0,0 +1,59 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Scheduling Event Trace
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+// Record scheduling events in the per-CPU trace rings
+#ifndef TRACE
+#define TRACE 1
+#endif
+
+#define TRACE_SIZE      1024    // Events per CPU (must be a power of two)
+
+// Trace event types
+typedef enum {
+    TRACE_SWITCH_IN = 1,        // Process starts running (arg: previous pid)
+    TRACE_SWITCH_OUT,           // Process stops running (arg: its state)
+    TRACE_WAKEUP,               // Process is made runnable (arg: state it leaves)
+    TRACE_SLEEP,                // Process sleeps (arg: ticks)
+    TRACE_BLOCK,                // Process blocks (arg: wait channel)
+    TRACE_SYSCALL_ENTER,        // System call starts (arg: system call id)
+    TRACE_SYSCALL_EXIT,         // System call returns (arg: return value)
+    TRACE_IRQ                   // Interrupt enters the kernel (arg: vector)
+} trace_type_t;
+
+// Trace event (16 bytes)
+typedef struct trace_event_t {
+    unsigned long long tsc;     // Time stamp counter when recorded
+    unsigned short type;        // Event type (trace_type_t)
+    short pid;                  // Process the event applies to (-1 if none)
+    unsigned int arg;           // Event specific argument
+} trace_event_t;
+
+// Per-CPU trace ring; the oldest events are overwritten
+typedef struct trace_ring_t {
+    trace_event_t events[TRACE_SIZE];
+    unsigned int head;          // Total number of events recorded
+} trace_ring_t;
+
+/**
+ * Records an event in the trace ring of the running CPU
+ * @param type - event type
+ * @param pid - process the event applies to, -1 if none
+ * @param arg - event specific argument
+ */
+void trace_event(trace_type_t type, int pid, unsigned int arg);
+
+/**
+ * Prints the trace rings of every CPU to the host console, oldest first
+ * One line per event: "T <cpu> <tsc> <type> <pid> <arg>" (hexadecimal
+ * TSC and argument). Types: I switch in, O switch out, W wakeup,
+ * S sleep, B block, C system call, R system call return, Q interrupt
+ */
+void trace_dump(void);
+
+#endif
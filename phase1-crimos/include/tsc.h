@@ -0,0 +1,39 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Time Stamp Counter helpers
+ */
+#ifndef TSC_H
+#define TSC_H
+
+/**
+ * Reads the CPU time stamp counter
+ * @return number of CPU cycles since reset
+ */
+static inline unsigned long long tsc_read(void) {
+    unsigned int lo;
+    unsigned int hi;
+
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/**
+ * Divides a 64-bit value by a 32-bit value without pulling in libgcc
+ * @param n - dividend
+ * @param d - divisor
+ * @return quotient
+ * @note the quotient must fit in 32 bits or the CPU will fault
+ */
+static inline unsigned int tsc_div(unsigned long long n, unsigned int d) {
+    unsigned int q;
+    unsigned int r;
+
+    asm("divl %4" : "=a"(q), "=d"(r) : "a"((unsigned int)n), "d"((unsigned int)(n >> 32)), "rm"(d));
+
+    return q;
+}
+
+#endif
@@ -9,6 +9,7 @@
 #define TTY_H
 
 #include "kproc.h"
+#include "syscall_common.h"
 
 #ifndef TTY_MAX
 #define TTY_MAX         10  // Maximum number of TTYs to support
@@ -23,6 +24,14 @@
 
 #define TTY_BUF_SIZE (TTY_WIDTH * (TTY_HEIGHT + TTY_SCROLLBACK))
 
+#ifndef TTY_LATENCY_PENDING
+#define TTY_LATENCY_PENDING 16  // Keystrokes that can await an echo
+#endif
+
+// Latency histogram: 32 power-of-two ranges, each split into 4 sub-buckets
+#define TTY_LATENCY_SUB_BITS    2
+#define TTY_LATENCY_BUCKETS     (32 << TTY_LATENCY_SUB_BITS)
+
 
 // TTY data structure
 // Describes the virtual TTY
@@ -45,6 +54,10 @@ typedef struct tty_t {
 
     ringbuf_t io_input;         // Input buffer
     ringbuf_t io_output;        // Output buffer
+
+    // Timestamps (TSC) of keystrokes that have not been echoed yet
+    unsigned long long input_tsc[TTY_LATENCY_PENDING];
+    int input_pending;
 } tty_t;
 
 /**
@@ -78,8 +91,16 @@ struct tty_t *tty_get(int tty);
  * If the echo flag is set, will also write the character into the TTY
  * process output buffer
  * @param c - character to write into the input buffer
+ * @param tsc - time stamp counter value when the key was received
  */
-void tty_input(char c);
+void tty_input(char c, unsigned long long tsc);
+
+/**
+ * Write a character received on the serial port into the serial TTY
+ * input buffer, echoing it back out of the serial port if enabled
+ * @param c - character to write into the input buffer
+ */
+void tty_serial_input(char c);
 
 /**
  * Updates the TTY with the given character
@@ -109,4 +130,22 @@ void tty_scroll_top(void);
  */
 void tty_scroll_bottom(void);
 
+/**
+ * Obtains the keystroke-to-echo latency statistics
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 on error
+ */
+int tty_latency_get(latency_stat_t *stat);
+
+/**
+ * Prints the keystroke-to-echo latency histogram to the host
+ */
+void tty_latency_dump(void);
+
+/**
+ * Indicates if the tty has output to draw or send
+ * @return 1 if tty_refresh has work to do, 0 otherwise
+ */
+int tty_pending(void);
+
 #endif
@@ -0,0 +1,51 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * 16550 UART (COM1) Driver
+ */
+#ifndef UART_H
+#define UART_H
+
+#include "tty.h"
+
+// Build the COM1 driver
+// Off by default: the SPEDE host link may be using a serial port
+#ifndef UART
+#define UART 0
+#endif
+
+#ifndef UART_BAUD
+#define UART_BAUD       115200  // Line speed (bits per second)
+#endif
+
+#define UART_TTY        (TTY_MAX - 1)   // TTY attached to COM1
+
+/**
+ * Initializes COM1 for interrupt driven transmit and receive
+ * Does nothing if the driver is not built or no UART is present
+ */
+void uart_init(void);
+
+/**
+ * Indicates if COM1 is present and initialized
+ * @return 1 if present, 0 otherwise
+ */
+int uart_present(void);
+
+/**
+ * Queues bytes for transmission on COM1
+ * Never waits: bytes that do not fit in the transmit ring are dropped
+ * @param buf - bytes to send
+ * @param n - number of bytes
+ * @return number of bytes queued, -1 if COM1 is not present
+ */
+int uart_write(char *buf, int n);
+
+/**
+ * COM1 IRQ handler
+ * Passes received bytes to the serial TTY and refills the transmit FIFO
+ */
+void uart_irq_handler(void);
+
+#endif
@@ -0,0 +1,290 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Local APIC and IOAPIC Implementation
+ */
+#include "apic.h"
+#include "interrupts.h"
+#include "kernel.h"
+#include "smp.h"
+#include "tsc.h"
+
+// CPUID / MSR Definitions
+#define CPUID_FEAT_APIC     (1 << 9)    // CPUID.1:EDX APIC present
+#define MSR_APIC_BASE       0x1b        // IA32_APIC_BASE MSR
+#define MSR_APIC_BASE_EN    (1 << 11)   // APIC global enable
+
+// Local APIC register offsets
+#define APIC_REG_ID         0x020       // Local APIC id
+#define APIC_REG_TPR        0x080       // Task priority
+#define APIC_REG_EOI        0x0b0       // End of interrupt
+#define APIC_REG_SVR        0x0f0       // Spurious interrupt vector
+#define APIC_REG_ICR_LO     0x300       // Interrupt command (low)
+#define APIC_REG_ICR_HI     0x310       // Interrupt command (high)
+#define APIC_REG_LVT_TIMER  0x320       // LVT timer
+#define APIC_REG_TIMER_INIT 0x380       // Timer initial count
+#define APIC_REG_TIMER_CUR  0x390       // Timer current count
+#define APIC_REG_TIMER_DIV  0x3e0       // Timer divide configuration
+
+#define APIC_SVR_ENABLE     0x100       // Software enable bit
+#define APIC_ICR_PENDING    (1 << 12)   // IPI delivery pending
+#define APIC_LVT_MASKED     (1 << 16)   // LVT entry masked
+#define APIC_LVT_PERIODIC   (1 << 17)   // LVT timer periodic mode
+#define APIC_TIMER_DIV_16   0x3         // Divide the bus clock by 16
+
+// IOAPIC register offsets
+#define IOAPIC_REGSEL       0x00        // Register select
+#define IOAPIC_WIN          0x10        // Register data window
+#define IOAPIC_REG_VER      0x01        // Version and maximum redirection entry
+#define IOAPIC_REDTBL(n)    (0x10 + 2 * (n))
+#define IOAPIC_ACTIVE_LOW   (1 << 13)   // Redirection entry input polarity
+#define IOAPIC_LEVEL        (1 << 15)   // Redirection entry trigger mode
+#define IOAPIC_MASKED       (1 << 16)   // Redirection entry masked
+
+// Local APIC MMIO base address (NULL when the APIC is not in use)
+volatile unsigned int *apic_base = NULL;
+
+// IOAPIC MMIO base address
+volatile unsigned int *ioapic_base = NULL;
+
+// IOAPIC input each ISA IRQ is wired to
+ioapic_route_t ioapic_routes[IOAPIC_ISA_IRQS];
+
+// Local APIC timer counts per timer tick
+unsigned int apic_timer_count;
+
+/**
+ * Reads a local APIC register
+ * @param reg - register offset
+ * @return register value
+ */
+static inline unsigned int apic_read(int reg) {
+    return apic_base[reg / 4];
+}
+
+/**
+ * Writes a local APIC register
+ * @param reg - register offset
+ * @param value - value to write
+ */
+static inline void apic_write(int reg, unsigned int value) {
+    apic_base[reg / 4] = value;
+}
+
+/**
+ * Reads an IOAPIC register
+ * @param reg - register index
+ * @return register value
+ */
+static unsigned int ioapic_read(int reg) {
+    ioapic_base[IOAPIC_REGSEL / 4] = reg;
+    return ioapic_base[IOAPIC_WIN / 4];
+}
+
+/**
+ * Writes an IOAPIC register
+ * @param reg - register index
+ * @param value - value to write
+ */
+static void ioapic_write(int reg, unsigned int value) {
+    ioapic_base[IOAPIC_REGSEL / 4] = reg;
+    ioapic_base[IOAPIC_WIN / 4] = value;
+}
+
+/**
+ * Spurious interrupt handler; spurious interrupts must not be acknowledged
+ */
+void apic_spurious_handler(void) {
+    kernel_log_debug("apic: spurious interrupt");
+}
+
+/**
+ * Detects and enables the local APIC and IOAPIC
+ * The legacy PIC must be masked by the caller
+ * @return 0 on success, -1 if the APIC is not available
+ */
+int apic_init(void) {
+    unsigned int eax = 1;
+    unsigned int ebx;
+    unsigned int ecx = 0;
+    unsigned int edx;
+    unsigned int lo;
+    unsigned int hi;
+    unsigned int ioapic_addr;
+    int pins;
+
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+    if ((edx & CPUID_FEAT_APIC) == 0) {
+        kernel_log_warn("apic: local APIC not present");
+        return -1;
+    }
+
+    // Ensure the APIC is globally enabled and locate its registers
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(MSR_APIC_BASE));
+    lo |= MSR_APIC_BASE_EN;
+    asm volatile("wrmsr" : : "a"(lo), "d"(hi), "c"(MSR_APIC_BASE));
+
+    apic_base = (volatile unsigned int *)(lo & 0xfffff000);
+
+    // Locate the IOAPIC and the ISA interrupt overrides in the MP table
+    ioapic_addr = smp_mp_ioapic(ioapic_routes);
+
+    if (!ioapic_addr) {
+        ioapic_addr = IOAPIC_BASE_DEFAULT;
+
+        for (int irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+            ioapic_routes[irq].pin = irq;
+            ioapic_routes[irq].active_low = 0;
+            ioapic_routes[irq].level = 0;
+        }
+    }
+
+    ioapic_base = (volatile unsigned int *)ioapic_addr;
+
+    // Mask every IOAPIC input until a handler is registered
+    pins = ((ioapic_read(IOAPIC_REG_VER) >> 16) & 0xff) + 1;
+
+    for (int i = 0; i < pins; i++) {
+        ioapic_write(IOAPIC_REDTBL(i), IOAPIC_MASKED);
+        ioapic_write(IOAPIC_REDTBL(i) + 1, 0);
+    }
+
+    for (int irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+        if (ioapic_routes[irq].pin != irq) {
+            kernel_log_debug("apic: ISA IRQ %d is wired to IOAPIC pin %d", irq, ioapic_routes[irq].pin);
+        }
+    }
+
+    // Accept all interrupt priorities and software-enable the APIC
+    apic_write(APIC_REG_TPR, 0);
+    apic_write(APIC_REG_SVR, APIC_SVR_ENABLE | IRQ_SPURIOUS);
+
+    interrupts_irq_register(IRQ_SPURIOUS, isr_entry_spurious, apic_spurious_handler);
+
+    kernel_log_info("apic: local APIC %d enabled at 0x%08x", apic_id(), (unsigned int)apic_base);
+
+    return 0;
+}
+
+/**
+ * Enables the local APIC of an application processor
+ */
+void apic_ap_init(void) {
+    apic_write(APIC_REG_TPR, 0);
+    apic_write(APIC_REG_SVR, APIC_SVR_ENABLE | IRQ_SPURIOUS);
+}
+
+/**
+ * Sends an inter-processor interrupt
+ * @param apic_id - destination local APIC id
+ * @param icr - delivery mode and vector
+ */
+void apic_ipi(int apic_id, unsigned int icr) {
+    apic_write(APIC_REG_ICR_HI, apic_id << 24);
+    apic_write(APIC_REG_ICR_LO, icr);
+
+    while (apic_read(APIC_REG_ICR_LO) & APIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+}
+
+/**
+ * Indicates if the APIC has been enabled
+ * @return 1 if enabled, 0 if not enabled
+ */
+int apic_enabled(void) {
+    return apic_base != NULL;
+}
+
+/**
+ * Returns the id of the local APIC of the running CPU
+ * @return local APIC id
+ */
+int apic_id(void) {
+    return apic_read(APIC_REG_ID) >> 24;
+}
+
+/**
+ * Signals the end of interrupt to the local APIC
+ */
+void apic_eoi(void) {
+    apic_write(APIC_REG_EOI, 0);
+}
+
+/**
+ * Routes an ISA IRQ through the IOAPIC to the given vector
+ * @param irq - IRQ vector (0x20 - 0x2f)
+ */
+void ioapic_irq_enable(int irq) {
+    ioapic_route_t *route = &ioapic_routes[irq & 0xf];
+    int pin = route->pin;
+    unsigned int entry = irq;
+
+    // Fixed delivery, physical destination, polarity and trigger per the MP table
+    if (route->active_low) {
+        entry |= IOAPIC_ACTIVE_LOW;
+    }
+
+    if (route->level) {
+        entry |= IOAPIC_LEVEL;
+    }
+
+    ioapic_write(IOAPIC_REDTBL(pin) + 1, apic_id() << 24);
+    ioapic_write(IOAPIC_REDTBL(pin), entry);
+
+    kernel_log_trace("apic: routed IOAPIC pin %d to vector 0x%02x", pin, irq);
+}
+
+/**
+ * Masks an ISA IRQ in the IOAPIC
+ * @param irq - IRQ vector (0x20 - 0x2f)
+ */
+void ioapic_irq_disable(int irq) {
+    ioapic_write(IOAPIC_REDTBL(ioapic_routes[irq & 0xf].pin), IOAPIC_MASKED);
+}
+
+/**
+ * Calibrates the local APIC timer against the time stamp counter
+ * @param tsc_per_tick - TSC cycles per timer tick
+ */
+void apic_timer_init(unsigned int tsc_per_tick) {
+    unsigned long long start;
+
+    // Count down from the maximum value for one tick with the timer masked
+    apic_write(APIC_REG_TIMER_DIV, APIC_TIMER_DIV_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED | IRQ_TIMER);
+    apic_write(APIC_REG_TIMER_INIT, 0xffffffff);
+
+    start = tsc_read();
+    while (tsc_read() - start < tsc_per_tick);
+
+    apic_timer_count = 0xffffffff - apic_read(APIC_REG_TIMER_CUR);
+    apic_write(APIC_REG_TIMER_INIT, 0);
+
+    kernel_log_info("apic: timer calibrated at %u counts per tick", apic_timer_count);
+}
+
+/**
+ * Starts the local APIC timer firing once every timer tick
+ */
+void apic_timer_periodic(void) {
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_PERIODIC | IRQ_TIMER);
+    apic_write(APIC_REG_TIMER_INIT, apic_timer_count);
+}
+
+/**
+ * Arms the local APIC timer to fire once after the given ticks
+ * @param ticks - number of timer ticks
+ */
+void apic_timer_oneshot(int ticks) {
+    unsigned long long count = (unsigned long long)apic_timer_count * ticks;
+
+    if (count > 0xffffffff) {
+        count = 0xffffffff;
+    }
+
+    apic_write(APIC_REG_LVT_TIMER, IRQ_TIMER);
+    apic_write(APIC_REG_TIMER_INIT, (unsigned int)count);
+}
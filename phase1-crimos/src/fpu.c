@@ -0,0 +1,201 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Lazy FPU/SSE Context Switching
+ *
+ * Each process has its own FXSAVE area. The FPU registers are left
+ * loaded with the state of the last process that used them (the FPU
+ * owner of the CPU). Switching to any other process sets CR0.TS so that
+ * its first FPU/SSE instruction raises #NM; only then is the owner's
+ * state saved and the new process' state restored.
+ */
+#include <spede/string.h>
+
+#include "fpu.h"
+#include "interrupts.h"
+#include "kernel.h"
+#include "kproc.h"
+#include "smp.h"
+
+#define CR0_MP              (1 << 1)    // Monitor coprocessor
+#define CR0_EM              (1 << 2)    // x87 emulation
+#define CR0_TS              (1 << 3)    // Task switched
+#define CR0_NE              (1 << 5)    // Native x87 error reporting
+#define CR4_OSFXSR          (1 << 9)    // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT      (1 << 10)   // Unmasked SIMD exceptions supported
+
+#define CPUID_FEAT_FXSR     (1 << 24)   // FXSAVE/FXRSTOR present
+#define CPUID_FEAT_SSE      (1 << 25)   // SSE present
+
+// Indicates if lazy FPU switching is available
+int fpu_enabled = 0;
+
+// Initial FPU state given to a process the first time it uses the FPU
+unsigned char fpu_init_state[PROC_FPU_STATE_SIZE] __attribute__((aligned(16)));
+
+static inline unsigned int fpu_cr0_read(void) {
+    unsigned int cr0;
+    asm volatile("movl %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void fpu_cr0_write(unsigned int cr0) {
+    asm volatile("movl %0, %%cr0" : : "r"(cr0));
+}
+
+/**
+ * Sets CR0.TS so the next FPU instruction traps
+ * @param cpu - pointer to the running CPU entry
+ */
+static void fpu_ts_set(cpu_t *cpu) {
+    if (!cpu->fpu_ts) {
+        fpu_cr0_write(fpu_cr0_read() | CR0_TS);
+        cpu->fpu_ts = 1;
+    }
+}
+
+/**
+ * Clears CR0.TS so FPU instructions execute
+ * @param cpu - pointer to the running CPU entry
+ */
+static void fpu_ts_clear(cpu_t *cpu) {
+    if (cpu->fpu_ts) {
+        asm volatile("clts");
+        cpu->fpu_ts = 0;
+    }
+}
+
+/**
+ * Device-not-available (#NM) handler
+ * Hands the FPU registers to the active process
+ */
+void fpu_nm_handler(void) {
+    cpu_t *cpu = smp_cpu();
+    proc_t *proc = cpu->current;
+
+    if (!fpu_enabled || !proc) {
+        kernel_panic("fpu: unexpected device-not-available exception");
+        return;
+    }
+
+    fpu_ts_clear(cpu);
+
+    if (cpu->fpu_owner == proc) {
+        return;
+    }
+
+    // Save the state of the previous owner
+    if (cpu->fpu_owner) {
+        asm volatile("fxsave %0" : "=m"(cpu->fpu_owner->fpu_state));
+    }
+
+    // Restore this process' state, or start it from a clean state
+    if (proc->fpu_used) {
+        asm volatile("fxrstor %0" : : "m"(proc->fpu_state));
+    } else {
+        asm volatile("fxrstor %0" : : "m"(fpu_init_state));
+        proc->fpu_used = 1;
+    }
+
+    cpu->fpu_owner = proc;
+}
+
+/**
+ * Prepares the FPU of the running CPU for the process about to run
+ * Sets CR0.TS unless the process already owns the FPU registers
+ * @param cpu - pointer to the running CPU entry
+ * @param proc - pointer to the process that will run
+ */
+void fpu_switch(cpu_t *cpu, proc_t *proc) {
+    if (!fpu_enabled) {
+        return;
+    }
+
+    if (cpu->fpu_owner == proc) {
+        fpu_ts_clear(cpu);
+        return;
+    }
+
+    // With more than one CPU the owner may be picked up elsewhere, where
+    // its registers cannot be reached, so save them as it is switched out
+    if (cpu->fpu_owner && smp_get_cpu_count() > 1) {
+        fpu_ts_clear(cpu);
+        asm volatile("fxsave %0" : "=m"(cpu->fpu_owner->fpu_state));
+        cpu->fpu_owner = NULL;
+    }
+
+    fpu_ts_set(cpu);
+}
+
+/**
+ * Discards the FPU state of a process that is being destroyed
+ * @param proc - pointer to the process entry
+ */
+void fpu_release(proc_t *proc) {
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+
+        if (cpu->fpu_owner == proc) {
+            cpu->fpu_owner = NULL;
+        }
+    }
+}
+
+/**
+ * Enables the FPU/SSE on the running CPU
+ */
+void fpu_cpu_init(void) {
+    cpu_t *cpu = smp_cpu();
+    unsigned int cr4;
+
+    if (!fpu_enabled) {
+        return;
+    }
+
+    fpu_cr0_write((fpu_cr0_read() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+    asm volatile("movl %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    asm volatile("movl %0, %%cr4" : : "r"(cr4));
+
+    asm volatile("fninit");
+
+    cpu->fpu_owner = NULL;
+    cpu->fpu_ts = 0;
+
+    // Nothing owns the FPU yet
+    fpu_ts_set(cpu);
+}
+
+/**
+ * Initializes FPU/SSE support on the bootstrap CPU
+ * Registers the device-not-available (#NM) handler
+ */
+void fpu_init(void) {
+    unsigned int eax = 1;
+    unsigned int ebx;
+    unsigned int ecx = 0;
+    unsigned int edx;
+
+    kernel_log_info("Initializing FPU");
+
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+    if ((edx & CPUID_FEAT_FXSR) == 0) {
+        kernel_log_warn("fpu: FXSAVE not supported, processes may not use the FPU");
+        return;
+    }
+
+    fpu_enabled = 1;
+    fpu_cpu_init();
+
+    // Capture the power-on state (default control word and MXCSR)
+    fpu_ts_clear(smp_cpu());
+    asm volatile("fxsave %0" : "=m"(fpu_init_state));
+    fpu_ts_set(smp_cpu());
+
+    interrupts_irq_register(IRQ_NM, isr_entry_nm, fpu_nm_handler);
+
+    kernel_log_info("fpu: lazy switching enabled%s", (edx & CPUID_FEAT_SSE) ? " (SSE)" : "");
+}
@@ -9,11 +9,12 @@
 #include <spede/machine/seg.h>
 #include <spede/string.h>
 
+#include "apic.h"
 #include "kernel.h"
 #include "interrupts.h"
-
-// Maximum number of ISR handlers
-#define IRQ_MAX      0xf0
+#include "smp.h"
+#include "timer.h"
+#include "tsc.h"
 
 // PIC Definitions
 #define PIC1_BASE   0x20            // base address for PIC primary controller
@@ -24,6 +25,15 @@
 #define PIC2_DATA   (PIC2_BASE+1)   // address for setting data for PIC2
 
 #define PIC_EOI     0x20            // PIC End-of-Interrupt command
+#define PIC_EOI_SPECIFIC 0x60       // PIC Specific End-of-Interrupt command (| IRQ)
+
+#define PIC_ICW1_INIT   0x11        // Start initialization, ICW4 follows
+#define PIC_ICW4_8086   0x01        // 8086 mode
+#define PIC_ICW4_AEOI   0x02        // Automatic End-of-Interrupt
+
+#define PIC_SET_PRIORITY 0xc0       // PIC Set Priority command (| lowest priority IRQ)
+
+#define PIC_CASCADE_IRQ 2           // Primary PIC IRQ the secondary PIC is wired to
 
 // Interrupt descriptor table
 struct i386_gate *idt = NULL;
@@ -33,6 +43,26 @@ struct i386_gate *idt = NULL;
 // the various interrupts to be handled
 void (*irq_handlers[IRQ_MAX])();
 
+// Interrupt controller selected at boot; may be changed from the debugger
+// before the kernel starts (0 = PIC, 1 = APIC, -1 = APIC if an IOAPIC is listed)
+int interrupts_apic = INTERRUPTS_APIC;
+
+// Shadow copies of the primary and secondary PIC masks (bit set = masked)
+unsigned char pic_mask[2];
+
+// Per-vector statistics (updated with the kernel lock held)
+struct irq_account {
+    unsigned int count;                     // Interrupts handled
+    unsigned int timed;                     // Interrupts with a measured duration
+    unsigned long long cycles;              // Total measured handler cycles
+    unsigned int cycles_max;                // Longest handler duration
+    unsigned int hist[IRQ_STAT_BUCKETS];    // Handler durations by power of two
+} irq_accounts[IRQ_MAX];
+
+// Work deferred by nested handlers until the nestable sections end, per CPU
+static void (*irq_deferred[CPU_MAX][IRQ_DEFER_MAX])(void);
+static int irq_deferred_count[CPU_MAX];
+
 /**
  * Enable interrupts with the CPU
  */
@@ -49,6 +79,244 @@ void interrupts_disable(void) {
     asm("cli");
 }
 
+/**
+ * Converts a cycle count to nanoseconds
+ * @param cycles - TSC cycles
+ * @return nanoseconds, saturated to 32 bits
+ */
+static unsigned int irq_cycles_to_ns(unsigned long long cycles) {
+    unsigned long long ns = timer_cycles_to_ns(cycles);
+
+    return (ns > 0xffffffffULL) ? 0xffffffff : (unsigned int)ns;
+}
+
+/**
+ * Runs the handler of the given vector and records how long it took
+ * A handler that blocked the interrupted process (the CPU switched to
+ * another process before it returned) is counted but not timed
+ * @param irq - IRQ number
+ */
+static void irq_account_handle(int irq) {
+    struct irq_account *acct = &irq_accounts[irq];
+    cpu_t *cpu = smp_cpu();
+    unsigned int switches = cpu->exit_full;
+    int prev = cpu->irq_current;
+    unsigned long long start = tsc_read();
+    unsigned long long delta;
+    unsigned int cycles;
+
+    cpu->irq_current = irq;
+
+    irq_handlers[irq]();
+
+    // The handler may have blocked and resumed on another CPU
+    smp_cpu()->irq_current = prev;
+
+    acct->count++;
+
+    if (smp_cpu() != cpu || cpu->exit_full != switches) {
+        return;
+    }
+
+    delta = tsc_read() - start;
+    cycles = (delta > 0xffffffffULL) ? 0xffffffff : (unsigned int)delta;
+
+    acct->timed++;
+    acct->cycles += cycles;
+    acct->hist[cycles ? 31 - __builtin_clz(cycles) : 0]++;
+
+    if (cycles > acct->cycles_max) {
+        acct->cycles_max = cycles;
+    }
+}
+
+/**
+ * Records the end of the running CPU's interrupts-disabled window
+ * @param tsc - time stamp counter value when interrupts are re-enabled
+ */
+void interrupts_off_end(unsigned long long tsc) {
+    cpu_t *cpu = smp_cpu();
+    unsigned long long off;
+
+    if (!cpu->irq_off_tsc) {
+        return;
+    }
+
+    off = tsc - cpu->irq_off_tsc;
+
+    if (off > cpu->irq_off_max) {
+        cpu->irq_off_max = (off > 0xffffffffULL) ? 0xffffffff : (unsigned int)off;
+    }
+
+    cpu->irq_off_tsc = 0;
+}
+
+/**
+ * Re-enables interrupts within the body of an IRQ handler so that IRQs
+ * of a higher priority can be handled before it completes
+ * The interrupt controller keeps the running IRQ and lower priority ones
+ * blocked until the handler is dismissed. The section must not touch
+ * anything a nested handler may change.
+ * @return 1 if interrupts were enabled, 0 if nesting is not possible here
+ */
+int interrupts_nest_begin(void) {
+    cpu_t *cpu = smp_cpu();
+
+    if (!INTERRUPTS_NESTED) {
+        return 0;
+    }
+
+    // Only device IRQs are held off by the controller while in service;
+    // in auto-EOI mode the PIC no longer tracks them at all
+    if (cpu->irq_current < 0x20 || cpu->irq_current > 0x2f) {
+        return 0;
+    }
+
+    if (PIC_AUTO_EOI && !apic_enabled()) {
+        return 0;
+    }
+
+    interrupts_off_end(tsc_read());
+
+    smp_irq_depth[cpu->id]++;
+    asm volatile("sti" : : : "memory");
+
+    return 1;
+}
+
+/**
+ * Disables interrupts again at the end of a nestable section
+ * @param nested - value returned by interrupts_nest_begin
+ */
+void interrupts_nest_end(int nested) {
+    cpu_t *cpu;
+
+    if (!nested) {
+        return;
+    }
+
+    asm volatile("cli" : : : "memory");
+
+    cpu = smp_cpu();
+    smp_irq_depth[cpu->id]--;
+    cpu->irq_off_tsc = tsc_read();
+
+    if (smp_irq_depth[cpu->id] > 0) {
+        return;
+    }
+
+    // Nested handlers are done; run what they left for this point
+    for (int i = 0; i < irq_deferred_count[cpu->id]; i++) {
+        irq_deferred[cpu->id][i]();
+    }
+
+    irq_deferred_count[cpu->id] = 0;
+}
+
+/**
+ * Defers work from a nested handler until the nestable sections on this
+ * CPU end. Nested handlers only save what the device gave them and defer
+ * the rest (waking processes, hotkeys), which may touch state the
+ * interrupted section is using
+ * @param func - function to run (queued once however often it is deferred)
+ * @return 0 on success, -1 if too much work is deferred
+ */
+int interrupts_defer(void (*func)(void)) {
+    int id = smp_cpu()->id;
+
+    for (int i = 0; i < irq_deferred_count[id]; i++) {
+        if (irq_deferred[id][i] == func) {
+            return 0;
+        }
+    }
+
+    if (irq_deferred_count[id] >= IRQ_DEFER_MAX) {
+        return -1;
+    }
+
+    irq_deferred[id][irq_deferred_count[id]++] = func;
+    return 0;
+}
+
+/**
+ * Obtains the statistics for an interrupt vector
+ * @param irq - IRQ number
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 if the vector is invalid or has no handler
+ */
+int interrupts_irq_stat(int irq, irq_stat_t *stat) {
+    struct irq_account *acct;
+    unsigned int off_max = 0;
+    unsigned int rank;
+    unsigned int seen = 0;
+
+    if (irq < 0 || irq >= IRQ_MAX || !stat || !irq_handlers[irq]) {
+        return -1;
+    }
+
+    acct = &irq_accounts[irq];
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        if (smp_get_cpu(i)->started && smp_get_cpu(i)->irq_off_max > off_max) {
+            off_max = smp_get_cpu(i)->irq_off_max;
+        }
+    }
+
+    memset(stat, 0, sizeof(*stat));
+    stat->irq = irq;
+    stat->count = acct->count;
+    stat->max_ns = irq_cycles_to_ns(acct->cycles_max);
+    stat->off_max_ns = irq_cycles_to_ns(off_max);
+
+    if (acct->timed) {
+        stat->avg_ns = irq_cycles_to_ns(tsc_div(acct->cycles, acct->timed));
+
+        // Upper bound of the bucket holding the 99th percentile
+        rank = tsc_div(acct->timed * 99ULL + 99, 100);
+
+        for (int i = 0; i < IRQ_STAT_BUCKETS; i++) {
+            seen += acct->hist[i];
+
+            if (seen >= rank) {
+                unsigned long long bound = (2ULL << i) - 1;
+
+                stat->p99_ns = irq_cycles_to_ns(bound < acct->cycles_max ? bound : acct->cycles_max);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Prints the statistics of every interrupt vector that has been handled
+ */
+void interrupts_dump(void) {
+    irq_stat_t stat;
+
+    kernel_log_info("interrupts: vector      count     avg ns     p99 ns     max ns");
+
+    for (int irq = 0; irq < IRQ_MAX; irq++) {
+        if (interrupts_irq_stat(irq, &stat) != 0 || stat.count == 0) {
+            continue;
+        }
+
+        kernel_log_info("interrupts:   0x%02x %10u %10u %10u %10u",
+                        irq, stat.count, stat.avg_ns, stat.p99_ns, stat.max_ns);
+    }
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        if (!smp_get_cpu(i)->started) {
+            continue;
+        }
+
+        kernel_log_info("interrupts: cpu %d longest interrupts-off window %u ns, nested %u (depth %d)",
+                        i, irq_cycles_to_ns(smp_get_cpu(i)->irq_off_max),
+                        smp_get_cpu(i)->irq_nested, smp_get_cpu(i)->irq_depth_max);
+    }
+}
+
 /**
  * Handles the specified interrupt by dispatching to the registered function
  * @param interrupt - interrupt number
@@ -64,11 +332,17 @@ void interrupts_irq_handler(int irq) {
         return;
     }
 
-    irq_handlers[irq]();
-
-    /* If the IRQ originates from the PIC, dismiss the IRQ */
-    if (irq >= 0x20 && irq <= 0x2F) {
-        pic_irq_dismiss(irq - 0x20);
+    irq_account_handle(irq);
+
+    /* If the IRQ originates from the PIC or APIC, dismiss the IRQ */
+    if (irq == IRQ_RESCHED) {
+        apic_eoi();
+    } else if (irq >= 0x20 && irq <= 0x2F) {
+        if (apic_enabled()) {
+            apic_eoi();
+        } else {
+            pic_irq_dismiss(irq - 0x20);
+        }
     }
 }
 
@@ -105,13 +379,26 @@ void interrupts_irq_register(int irq, void (*entry)(), void (*handler)()) {
     kernel_log_debug("interrupts: IRQ %d (0x%02x) handler added", irq, irq);
 
     /* If the interrupt originates from the PIC, enable IRQs */
+    /* With the APIC, ISA IRQs are routed by the IOAPIC; the timer is local */
     if (irq >= 0x20 && irq <= 0x2F) {
-        pic_irq_enable(irq);
+        if (!apic_enabled()) {
+            pic_irq_enable(irq);
+        } else if (irq != IRQ_TIMER) {
+            ioapic_irq_enable(irq);
+        }
     }
 
     kernel_log_info("interrupts: IRQ %d (0x%02x) registered)", irq, irq);
 }
 
+/**
+ * Writes the shadow mask of a PIC out to the device
+ * @param pic - 0 for the primary PIC, 1 for the secondary PIC
+ */
+static void pic_mask_write(int pic) {
+    outportb(pic ? PIC2_DATA : PIC1_DATA, pic_mask[pic]);
+}
+
 /**
  * Enables the specified IRQ on the PIC
  *
@@ -119,30 +406,34 @@ void interrupts_irq_register(int irq, void (*entry)(), void (*handler)()) {
  * @note IRQs > 0xf will be remapped
  */
 void pic_irq_enable(int irq) {
-    int port = PIC1_DATA;
-    int mask;
+    int pic;
+    int bit;
 
     // Isolate only the first nibble; handles remapping
     irq &= 0xf;
 
     // Select the secondary PIC if the IRQ is associated with it
-    if (irq >= 0x8) {
-        port = PIC2_DATA;
-        irq -= 0x8;
-    }
+    pic = irq >> 3;
+    bit = 1 << (irq & 0x7);
 
-    // Read the current mask
-    mask = inportb(port);
+    // IRQs on the secondary PIC arrive through the cascade line
+    if (pic && (pic_mask[0] & (1 << PIC_CASCADE_IRQ))) {
+        pic_mask[0] &= ~(1 << PIC_CASCADE_IRQ);
+        pic_mask_write(0);
+    }
 
-    // Set the IRQ
-    mask &= ~(1 << irq);
+    // Already enabled; leave the device alone
+    if (!(pic_mask[pic] & bit)) {
+        return;
+    }
 
-    outportb(port, mask);
+    // Clear the bit in the mask to enable the IRQ
+    pic_mask[pic] &= ~bit;
 
     // Write the mask out to the PIC
-    outportb(port, mask);
+    pic_mask_write(pic);
 
-    kernel_log_trace("interrupts: Enabled IRQ %d (0x%02x) via PIC port=0x%02x, mask=0x%02x", irq, irq, port, mask);
+    kernel_log_trace("interrupts: Enabled IRQ %d (0x%02x) via PIC %d, mask=0x%02x", irq, irq, pic, pic_mask[pic]);
 }
 
 /**
@@ -151,29 +442,29 @@ void pic_irq_enable(int irq) {
  * @param irq - IRQ that should be disabled
  */
 void pic_irq_disable(int irq) {
-    int port = PIC1_DATA;
-    int mask;
+    int pic;
+    int bit;
 
     // We only care about bits 0-7, this allows
     // us to handle remapped IRQs
     irq &= 0xf;
 
-    // Determine the PIC to be used and adjust the irq number
-    if (irq >= 0x8) {
-        port = PIC2_DATA;
-        irq -= 0x8;
-    }
+    // Determine the PIC to be used and the bit for the IRQ
+    pic = irq >> 3;
+    bit = 1 << (irq & 0x7);
 
-    // Read the current mask
-    mask = inportb(port);
+    // Already disabled; leave the device alone
+    if (pic_mask[pic] & bit) {
+        return;
+    }
 
     // Set the bit in the mask to disable the IRQ
-    mask = 0xff & (mask ^ (1 << irq));
+    pic_mask[pic] |= bit;
 
     // Write the mask back to the PIC
-    outportb(port, mask);
+    pic_mask_write(pic);
 
-    kernel_log_trace("interrupts: Disabled IRQ %d (0x%02x) via PIC port=0x%02x, mask=0x%02x", irq, irq, port, mask);
+    kernel_log_trace("interrupts: Disabled IRQ %d (0x%02x) via PIC %d, mask=0x%02x", irq, irq, pic, pic_mask[pic]);
 }
 
 /**
@@ -183,44 +474,82 @@ void pic_irq_disable(int irq) {
  * @return - 1 if enabled, 0 if disabled
  */
 int pic_irq_enabled(int irq) {
-    int port = PIC1_DATA;
-    int mask;
-
     // We only care about bits 0-7, this allows
     // us to handle remapped IRQs
     irq &= 0xf;
 
-    // Determine the PIC to be used and adjust the irq number
-    if (irq >= 0x8) {
-        port = PIC2_DATA;
-        irq -= 0x8;
-    }
-
-    // Read the current mask
-    mask = inportb(port);
-
-    return (mask & (1 << irq)) ? 0 : 1;
+    return (pic_mask[irq >> 3] & (1 << (irq & 0x7))) ? 0 : 1;
 }
 
 /**
  * Dismisses an interrupt by sending the EOI command to the appropriate
  * PIC device(s). If the IRQ is assosciated with the secondary PIC, the
  * EOI command must be issued to both since the PICs are dasiy-chained.
+ * Specific EOIs name the in-service IRQ, so the PIC does not have to
+ * resolve the highest priority one; nothing is sent in auto-EOI mode.
  *
  * @param irq - IRQ to be dismissed
  */
 void pic_irq_dismiss(int irq) {
+    if (PIC_AUTO_EOI) {
+        return;
+    }
+
     // We only care about bits 0-7, this allows
     // us to handle remapped IRQs
     irq &= 0xf;
 
     if (irq >= 0x8) {
-        // Send EOI to the secondary PIC
-        outportb(PIC2_CMD, PIC_EOI);
+        // Send EOI to the secondary PIC, then for the cascade line
+        outportb(PIC2_CMD, PIC_EOI_SPECIFIC | (irq - 0x8));
+        irq = PIC_CASCADE_IRQ;
     }
 
     // Send EOI to the primary PIC
-    outportb(PIC1_CMD, PIC_EOI);
+    outportb(PIC1_CMD, PIC_EOI_SPECIFIC | irq);
+}
+
+/**
+ * Masks every IRQ in both PICs
+ * Used when interrupts are delivered through the APIC instead
+ */
+void pic_disable(void) {
+    pic_mask[1] = 0xff;
+    pic_mask[0] = 0xff;
+    pic_mask_write(1);
+    pic_mask_write(0);
+}
+
+/**
+ * Initializes the PIC shadow masks from the devices
+ * In auto-EOI mode, both PICs are reprogrammed with the same vector
+ * offsets so that they dismiss each interrupt when it is acknowledged
+ */
+void pic_init(void) {
+    // The only time the masks are read from the devices
+    pic_mask[0] = inportb(PIC1_DATA);
+    pic_mask[1] = inportb(PIC2_DATA);
+
+    if (PIC_AUTO_EOI) {
+        outportb(PIC1_CMD, PIC_ICW1_INIT);
+        outportb(PIC2_CMD, PIC_ICW1_INIT);
+        outportb(PIC1_DATA, IRQ_TIMER);                 // ICW2: vector offset
+        outportb(PIC2_DATA, IRQ_TIMER + 0x8);
+        outportb(PIC1_DATA, 1 << PIC_CASCADE_IRQ);      // ICW3: secondary on IRQ 2
+        outportb(PIC2_DATA, PIC_CASCADE_IRQ);           // ICW3: cascade identity
+        outportb(PIC1_DATA, PIC_ICW4_8086 | PIC_ICW4_AEOI);
+        outportb(PIC2_DATA, PIC_ICW4_8086 | PIC_ICW4_AEOI);
+
+        // Initialization clears the masks; restore them
+        pic_mask_write(0);
+        pic_mask_write(1);
+
+        kernel_log_info("interrupts: PIC auto-EOI enabled");
+    } else if (INTERRUPTS_NESTED) {
+        // The timer fires most often and runs the longest handler; give
+        // it the lowest priority so every other IRQ can preempt it
+        outportb(PIC1_CMD, PIC_SET_PRIORITY | (IRQ_TIMER - 0x20));
+    }
 }
 
 /**
@@ -233,5 +562,19 @@ void interrupts_init() {
     idt = get_idt_base();
 
     memset(irq_handlers, 0, sizeof(irq_handlers));
+    memset(irq_accounts, 0, sizeof(irq_accounts));
+
+    // Select the interrupt controller, falling back to the PIC
+    if (interrupts_apic < 0) {
+        interrupts_apic = (smp_mp_ioapic(NULL) != 0);
+    }
+
+    if (interrupts_apic && apic_init() == 0) {
+        pic_disable();
+        kernel_log_info("interrupts: using the APIC");
+    } else {
+        pic_init();
+        kernel_log_info("interrupts: using the 8259 PIC");
+    }
 }
 
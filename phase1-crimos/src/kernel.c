@@ -9,26 +9,68 @@
 #include <spede/stdio.h>
 #include <spede/string.h>
 
+#include "fpu.h"
 #include "interrupts.h"
 #include "kernel.h"
 #include "scheduler.h"
+#include "timer.h"
+#include "trace.h"
 #include "trapframe.h"
+#include "tsc.h"
+#include "uart.h"
 #include "vga.h"
 
 #ifndef KERNEL_LOG_LEVEL_DEFAULT
 #define KERNEL_LOG_LEVEL_DEFAULT KERNEL_LOG_LEVEL_DEBUG
 #endif
 
-// Global pointer to the current active process entry
-proc_t *active_proc = NULL;
+// Serializes kernel context execution across CPUs
+spinlock_t kernel_lock;
 
 // Current log level
 int kernel_log_level = KERNEL_LOG_LEVEL_DEFAULT;
 
+// Log history, read with sys_log_read
+// Holds the most recent printed messages by sequence number
+kernel_log_record_t kernel_log_history[KERNEL_LOG_HISTORY_SIZE];
+volatile unsigned int kernel_log_history_seq = 0;
+
+// Bounds of the kernel_log_sites section, provided by the linker
+// Holds every kernel_log_* call site in link order
+extern kernel_log_site_t __start_kernel_log_sites[];
+extern kernel_log_site_t __stop_kernel_log_sites[];
+
+// Message prefix for each log level
+static char *kernel_log_prefix[] = { "", "error", "warn", "info", "debug", "trace", "" };
+
+// Deferred log ring
+// Producers reserve records by advancing the head; the kernel log process
+// prints them and advances the tail
+kernel_log_record_t kernel_log_ring[KERNEL_LOG_RING_SIZE];
+volatile unsigned int kernel_log_head = 0;
+volatile unsigned int kernel_log_tail = 0;
+
+// Messages are queued once the kernel log process is running
+volatile int kernel_log_deferred = 0;
+
+// Set when a message is queued into an empty ring; the kernel log process
+// is woken before the scheduler runs next
+volatile int kernel_log_wakeup = 0;
+
+// Number of messages dropped because the ring was full
+volatile unsigned int kernel_log_dropped = 0;
+unsigned int kernel_log_dropped_reported = 0;
+
+// Time stamp counter value when the kernel was initialized
+unsigned long long kernel_tsc_base = 0;
+
 /**
  * Initializes any kernel internal data structures and variables
  */
 void kernel_init(void) {
+    // Start the monotonic clock
+    kernel_tsc_base = tsc_read();
+
     // Display a welcome message on the host
     kernel_log_info("Welcome to %s!", OS_NAME);
 
@@ -36,121 +78,303 @@ void kernel_init(void) {
 }
 
 /**
- * Prints a kernel log message to the host with an error log level
+ * Keeps a printed message in the log history
+ * Each message gets the next sequence number; the oldest message is
+ * overwritten once the history is full
  *
- * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * @param level - log level of the message
+ * @param msg - formatted message
  */
-void kernel_log_error(char *msg, ...) {
-    // Return if our log level is less than error
-    if (kernel_log_level < KERNEL_LOG_LEVEL_ERROR) {
-        return;
+static void kernel_log_keep(int level, char *msg) {
+    unsigned int seq = __sync_add_and_fetch(&kernel_log_history_seq, 1);
+    kernel_log_record_t *record = &kernel_log_history[seq & (KERNEL_LOG_HISTORY_SIZE - 1)];
+
+    // Readers skip the record while it is being rewritten
+    record->seq = 0;
+    __sync_synchronize();
+
+    record->level = level;
+    strncpy(record->msg, msg, sizeof(record->msg) - 1);
+    record->msg[sizeof(record->msg) - 1] = 0;
+
+    __sync_synchronize();
+    record->seq = seq;
+}
+
+/**
+ * Copies kernel log messages from the log history, formatted as text lines
+ * ("<seq> <level>: <message>"), starting with the given sequence number
+ * Only whole lines are copied
+ *
+ * @param seq - in: sequence number of the first message to read (0 for the
+ *              oldest message kept), out: sequence number to continue from
+ * @param buf - buffer to copy the messages to
+ * @param n - size of the buffer
+ * @return number of bytes copied
+ */
+int kernel_log_read(unsigned int *seq, char *buf, int n) {
+    unsigned int last = kernel_log_history_seq;
+    unsigned int next = *seq;
+    int len = 0;
+
+    // Messages before the oldest one kept have been overwritten
+    if (last >= KERNEL_LOG_HISTORY_SIZE && next <= last - KERNEL_LOG_HISTORY_SIZE) {
+        next = last - KERNEL_LOG_HISTORY_SIZE + 1;
     }
 
-    va_list args;
+    if (next == 0) {
+        next = 1;
+    }
 
-    printf("error: ");
+    for (; next <= last; next++) {
+        kernel_log_record_t *record = &kernel_log_history[next & (KERNEL_LOG_HISTORY_SIZE - 1)];
+        kernel_log_record_t copy;
+        char line[KERNEL_LOG_MSG_LEN + 24];
+        int line_len;
 
-    va_start(args, msg);
-    vprintf(msg, args);
-    va_end(args);
+        memcpy(&copy, record, sizeof(copy));
+        __sync_synchronize();
 
-    printf("\n");
+        // The message is still being written; continue from it next time
+        if (copy.seq < next) {
+            break;
+        }
+
+        // The message was overwritten (before or while it was copied)
+        if (copy.seq != next || record->seq != next) {
+            continue;
+        }
+
+        copy.msg[sizeof(copy.msg) - 1] = 0;
+        line_len = snprintf(line, sizeof(line), "%u %s: %s\n", next, kernel_log_prefix[copy.level], copy.msg);
+
+        if (line_len < 0 || line_len >= (int)sizeof(line)) {
+            line_len = sizeof(line) - 1;
+        }
+
+        if (len + line_len > n) {
+            break;
+        }
+
+        memcpy(buf + len, line, line_len);
+        len += line_len;
+    }
+
+    *seq = next;
+    return len;
 }
 
 /**
- * Prints a kernel log message to the host with a warning log level
+ * Prints a formatted kernel log message to the log sink and keeps it in
+ * the log history
+ * The serial port sink never waits; lines that do not fit are dropped
  *
- * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * @param level - log level of the message
+ * @param msg - formatted message
  */
-void kernel_log_warn(char *msg, ...) {
-    // Return if our log level is less than warn
-    if (kernel_log_level < KERNEL_LOG_LEVEL_WARN) {
-        return;
-    }
+static void kernel_log_print(int level, char *msg) {
+    if (KERNEL_LOG_UART && uart_present()) {
+        char line[KERNEL_LOG_MSG_LEN + 16];
+        int len;
 
-    va_list args;
+        len = snprintf(line, sizeof(line), "%s: %s\r\n", kernel_log_prefix[level], msg);
 
-    printf("warn: ");
+        if (len > (int)sizeof(line) - 1) {
+            len = sizeof(line) - 1;
+        }
 
-    va_start(args, msg);
-    vprintf(msg, args);
-    va_end(args);
+        uart_write(line, len);
+    } else {
+        printf("%s: %s\n", kernel_log_prefix[level], msg);
+    }
 
-    printf("\n");
+    kernel_log_keep(level, msg);
 }
 
 /**
- * Prints a kernel log message to the host with an info log level
+ * Prints a kernel log message to the host console, or queues it in the
+ * log ring once the kernel log process is draining it
+ * Never blocks: a message is dropped (and counted) if the ring is full
  *
+ * @param level - log level of the message
  * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * @param args - variable arguments to pass in to the string format
  */
-void kernel_log_info(char *msg, ...) {
-    // Return if our log level is less than info
-    if (kernel_log_level < KERNEL_LOG_LEVEL_INFO) {
+static void kernel_log_write(int level, char *msg, va_list args) {
+    kernel_log_record_t *record;
+    unsigned int head;
+
+    if (!KERNEL_LOG_DEFERRED || !kernel_log_deferred) {
+        char buf[KERNEL_LOG_MSG_LEN];
+
+        vsnprintf(buf, sizeof(buf), msg, args);
+        kernel_log_print(level, buf);
         return;
     }
 
-    // Obtain the list of variable arguments
-    va_list args;
+    // Reserve a record; producers on other CPUs may race for the same one
+    do {
+        head = kernel_log_head;
 
-    // Indicate this is an 'info' type of message
-    printf("info: ");
+        if (head - kernel_log_tail >= KERNEL_LOG_RING_SIZE) {
+            __sync_fetch_and_add(&kernel_log_dropped, 1);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&kernel_log_head, head, head + 1));
 
-    // Pass the message variable arguments to vprintf
-    va_start(args, msg);
-    vprintf(msg, args);
-    va_end(args);
+    record = &kernel_log_ring[head & (KERNEL_LOG_RING_SIZE - 1)];
+    record->level = level;
+    vsnprintf(record->msg, sizeof(record->msg), msg, args);
 
-    printf("\n");
+    // Publish the record once its contents are visible
+    __sync_synchronize();
+    record->seq = head + 1;
+
+    // The kernel log process may be blocked on an empty ring. This can run
+    // outside the kernel lock, so the wakeup is left to kernel_log_wake
+    if (head == kernel_log_tail) {
+        kernel_log_wakeup = 1;
+    }
 }
 
 /**
- * Prints a kernel log message to the host with a debug log level
+ * Prints a kernel log message for the given call site
+ * Use the kernel_log_* macros rather than calling this directly
  *
+ * @param site - pointer to the call site of the message
  * @param msg - string format for the message to be displayed
  * @param ... - variable arguments to pass in to the string format
  */
-void kernel_log_debug(char *msg, ...) {
-    // Return if our log level is less than debug
-    if (kernel_log_level < KERNEL_LOG_LEVEL_DEBUG) {
-        return;
-    }
-
+void kernel_log(kernel_log_site_t *site, char *msg, ...) {
     va_list args;
 
-    printf("debug: ");
+    site->count++;
 
     va_start(args, msg);
-    vprintf(msg, args);
+    kernel_log_write(site->level, msg, args);
     va_end(args);
+}
 
-    printf("\n");
+/**
+ * Enables or disables logging from a call site
+ * Call sites are numbered in link order; sites above the build log level
+ * are not numbered
+ * @param index - call site number, -1 for every call site
+ * @param enabled - 1 to enable, 0 to disable
+ * @return 0 on success, -1 if there is no such call site
+ */
+int kernel_log_site_enable(int index, int enabled) {
+    int i = 0;
+
+    if (index < -1) {
+        return -1;
+    }
+
+    for (kernel_log_site_t *site = __start_kernel_log_sites; site < __stop_kernel_log_sites; site++) {
+        // Compiled out call sites remain in the section but never log
+        if (site->level > KERNEL_LOG_LEVEL_BUILD) {
+            continue;
+        }
+
+        if (index == -1 || index == i) {
+            site->enabled = enabled;
+
+            if (index == i) {
+                return 0;
+            }
+        }
+
+        i++;
+    }
+
+    return (index == -1) ? 0 : -1;
 }
 
 /**
- * Prints a kernel log message to the host with a trace log level
- *
- * @param msg - string format for the message to be displayed
- * @param ... - variable arguments to pass in to the string format
+ * Prints every call site compiled in, with its number, level,
+ * message count and whether it is enabled
  */
-void kernel_log_trace(char *msg, ...) {
-    // Return if our log level is less than trace
-    if (kernel_log_level < KERNEL_LOG_LEVEL_TRACE) {
-        return;
+void kernel_log_site_dump(void) {
+    int i = 0;
+
+    for (kernel_log_site_t *site = __start_kernel_log_sites; site < __stop_kernel_log_sites; site++) {
+        if (site->level > KERNEL_LOG_LEVEL_BUILD) {
+            continue;
+        }
+
+        printf("log site %3d %-5s %s %s:%d count=%u\n", i, kernel_log_prefix[site->level],
+               site->enabled ? "on " : "off", site->file, site->line, site->count);
+        i++;
     }
+}
 
-    va_list args;
+/**
+ * Prints the queued kernel log messages to the host console
+ * Run by the kernel log process; from its first call on, messages are
+ * queued instead of printed by the caller
+ */
+void kernel_log_drain(void) {
+    kernel_log_record_t record;
+    unsigned int tail;
+    unsigned int dropped;
 
-    printf("trace: ");
+    kernel_log_deferred = 1;
 
-    va_start(args, msg);
-    vprintf(msg, args);
-    va_end(args);
+    while ((tail = kernel_log_tail) != kernel_log_head) {
+        kernel_log_record_t *slot = &kernel_log_ring[tail & (KERNEL_LOG_RING_SIZE - 1)];
 
-    printf("\n");
+        // The producer has not finished writing the record yet
+        if (slot->seq != tail + 1) {
+            break;
+        }
+
+        // Copy the record out before releasing it to the producers
+        memcpy(&record, slot, sizeof(record));
+        __sync_synchronize();
+
+        if (!__sync_bool_compare_and_swap(&kernel_log_tail, tail, tail + 1)) {
+            continue;
+        }
+
+        kernel_log_print(record.level, record.msg);
+    }
+
+    dropped = kernel_log_dropped;
+
+    if (dropped != kernel_log_dropped_reported) {
+        printf("warn: log: %u messages dropped (%u total)\n",
+               dropped - kernel_log_dropped_reported, dropped);
+        kernel_log_dropped_reported = dropped;
+    }
+}
+
+/**
+ * Blocks the active process until kernel log messages are queued
+ * Must be called from the kernel context
+ */
+void kernel_log_wait(void) {
+    while (kernel_log_head == kernel_log_tail) {
+        kproc_block(kernel_log_ring);
+    }
+}
+
+/**
+ * Indicates if kernel log messages are waiting to be printed
+ * @return 1 if messages are queued, 0 otherwise
+ */
+int kernel_log_pending(void) {
+    return kernel_log_head != kernel_log_tail;
+}
+
+/**
+ * Wakes the kernel log process if messages were queued into an empty ring
+ * Called with the kernel lock held, before the scheduler runs
+ */
+static void kernel_log_wake(void) {
+    if (kernel_log_wakeup) {
+        kernel_log_wakeup = 0;
+        kproc_wakeup(kernel_log_ring);
+    }
 }
 
 /**
@@ -165,6 +389,9 @@ void kernel_log_trace(char *msg, ...) {
 void kernel_panic(char *msg, ...) {
     va_list args;
 
+    // Print what led up to the panic first
+    kernel_log_drain();
+
     printf("panic: ");
 
     va_start(args, msg);
@@ -204,10 +431,21 @@ int kernel_set_log_level(int level) {
     return kernel_log_level;
 }
 
+/**
+ * Returns the monotonic kernel clock
+ * @return nanoseconds since the kernel was initialized
+ */
+unsigned long long kernel_clock_ns(void) {
+    return timer_cycles_to_ns(tsc_read() - kernel_tsc_base);
+}
+
 /**
  * Exits the kernel
  */
 void kernel_exit(void) {
+    // Print the queued log messages
+    kernel_log_drain();
+
     // Print to the terminal
     printf("Exiting %s...\n", OS_NAME);
 
@@ -223,26 +461,238 @@ void kernel_exit(void) {
     exit(0);
 }
 
+/**
+ * Charges the TSC cycles since the last kernel entry or exit to the process
+ * that was running on the CPU
+ * @param cpu - pointer to the running CPU entry
+ * @param kernel - 1 if the cycles were spent in the kernel context,
+ *                 0 if they were spent running the process
+ */
+static void kernel_account(cpu_t *cpu, int kernel) {
+    unsigned long long now = tsc_read();
+    proc_t *proc = cpu->acct_proc;
+
+    if (proc && cpu->acct_tsc) {
+        if (kernel) {
+            proc->kernel_cycles += now - cpu->acct_tsc;
+        } else {
+            proc->user_cycles += now - cpu->acct_tsc;
+        }
+    }
+
+    cpu->acct_tsc = now;
+
+    // Leaving the kernel re-enables interrupts
+    if (kernel) {
+        interrupts_off_end(now);
+    }
+}
+
 /**
  * Kernel context entry point
+ * Returns to context.S only when the interrupted process resumes
  * @param trapframe - pointer to the current process' trapframe
  */
 void kernel_context_enter(trapframe_t *trapframe) {
-    if (active_proc) {
+    cpu_t *cpu;
+    proc_t *prev;
+    unsigned long long entry_tsc = tsc_read();
+
+    // Only one CPU may execute in the kernel context at a time
+    spin_lock(&kernel_lock);
+
+    cpu = smp_cpu();
+
+    // Interrupts have been off since the entry, including the lock wait
+    cpu->irq_off_tsc = entry_tsc;
+
+    // No handler is running yet (a blocked one may have left its vector)
+    cpu->irq_current = -1;
+
+    // The process ran until now
+    kernel_account(cpu, 0);
+
+    // System calls are traced by the system call handler
+    if (trapframe->interrupt != IRQ_SYSCALL) {
+        trace_event(TRACE_IRQ, cpu->current ? cpu->current->pid : -1, trapframe->interrupt);
+    }
+
+    // Restart the periodic tick if it was stopped while idle
+    timer_tickless_exit(trapframe->interrupt);
+
+    prev = cpu->current;
+
+    if (cpu->current) {
         // Save the currently running trapframe
-        active_proc->trapframe = trapframe;
+        cpu->current->trapframe = trapframe;
     }
 
     // Process the interrupt that occurred
     interrupts_irq_handler(trapframe->interrupt);
 
+    // The process may have blocked and resumed on another CPU
+    cpu = smp_cpu();
+
+    kernel_log_wake();
+
     // Run the scheduler
     scheduler_run();
 
-    if (!active_proc) {
+    if (!cpu->current) {
         kernel_panic("No active process!");
     }
 
+    // The interrupted process continues: take the fast return path
+    if (cpu->current == prev && cpu->current->trapframe == trapframe) {
+        // Make FPU use trap unless this process owns the FPU registers
+        fpu_switch(cpu, cpu->current);
+
+        kernel_account(cpu, 1);
+
+        cpu->exit_fast++;
+        spin_unlock(&kernel_lock);
+        return;
+    }
+
+    // Nothing is left on this kernel stack once the interrupt is handled
+    kernel_dispatch(cpu, NULL);
+}
+
+/**
+ * Nested interrupt entry point
+ * Handles an interrupt taken while a handler on this CPU runs with
+ * interrupts enabled. The CPU already holds the kernel lock and is in
+ * the middle of the interrupted handler, so nothing is scheduled: the
+ * handler returns to context.S, which resumes the interrupted handler.
+ * @param trapframe - pointer to the interrupted kernel state
+ */
+void kernel_context_nested(trapframe_t *trapframe) {
+    cpu_t *cpu = smp_cpu();
+    int depth = ++cpu->irq_depth;
+
+    // Interrupts are disabled again until the nested handler returns
+    cpu->irq_off_tsc = tsc_read();
+
+    if (depth > IRQ_NEST_MAX) {
+        kernel_panic("Interrupt nesting too deep (%d) on CPU %d", depth, cpu->id);
+    }
+
+    cpu->irq_nested++;
+
+    if (depth > cpu->irq_depth_max) {
+        cpu->irq_depth_max = depth;
+    }
+
+    trace_event(TRACE_IRQ, cpu->current ? cpu->current->pid : -1, trapframe->interrupt);
+
+    interrupts_irq_handler(trapframe->interrupt);
+
+    cpu->irq_depth--;
+
+    interrupts_off_end(tsc_read());
+}
+
+/**
+ * Releases the kernel lock and exits to the given process context
+ * @param trapframe - pointer to the trapframe to restore
+ */
+void kernel_context_leave(trapframe_t *trapframe) {
+    spin_unlock(&kernel_lock);
+
     // Exit the kernel context
-    kernel_context_exit(active_proc->trapframe);
+    kernel_context_exit(trapframe);
+}
+
+/**
+ * Resumes the active process of the CPU
+ * Switches to its kernel stack if it is blocked in the kernel, otherwise
+ * exits to its trapframe
+ * @param cpu - pointer to the running CPU entry
+ * @param save - where to save the kernel stack pointer of the caller,
+ *               NULL if the caller's stack is abandoned
+ */
+void kernel_dispatch(cpu_t *cpu, unsigned int *save) {
+    proc_t *proc = cpu->current;
+    unsigned int discard;
+    unsigned int esp;
+
+    if (!proc) {
+        kernel_panic("No active process!");
+    }
+
+    // Make FPU use trap unless this process owns the FPU registers
+    fpu_switch(cpu, proc);
+
+    // Interrupts taken by the process now enter on its own kernel stack
+    smp_kstack_top[cpu->id] = proc->kstack + PROC_KSTACK_SIZE;
+
+    esp = proc->kesp;
+    proc->kesp = 0;
+
+    // Kernel time so far belongs to the process that entered the kernel
+    kernel_account(cpu, 1);
+    cpu->acct_proc = proc;
+
+    // Nothing uses the entry of a process that exited any more. Its
+    // kernel stack is not cleared and cannot be reused before the kernel
+    // lock is released after the switch
+    if (cpu->exited) {
+        kproc_destroy(cpu->exited);
+        cpu->exited = NULL;
+    }
+
+    cpu->exit_full++;
+
+    // The kernel lock is handed over to the resumed kernel path, or
+    // released by kernel_context_leave
+    kernel_switch(save ? save : &discard, esp, proc->trapframe);
+}
+
+/**
+ * Runs the scheduler from within a kernel path
+ * If another process is selected, the kernel stack of the given process
+ * is saved and this function returns once it is scheduled again
+ * @param proc - process that owns the kernel stack in use
+ */
+void kernel_schedule(proc_t *proc) {
+    cpu_t *cpu = smp_cpu();
+    int irq = cpu->irq_current;
+
+    kernel_log_wake();
+    scheduler_run();
+
+    if (cpu->current != proc) {
+        kernel_dispatch(cpu, &proc->kesp);
+
+        // The kernel path may resume on another CPU
+        smp_cpu()->irq_current = irq;
+    }
+}
+
+/**
+ * Kernel preemption point
+ * Lets other processes run if the active process' time slice has expired
+ * or a woken process should preempt it. Only system call paths are
+ * preempted; interrupt handlers run to completion
+ */
+void kernel_preempt(void) {
+    cpu_t *cpu = smp_cpu();
+    proc_t *proc = cpu->current;
+    int used;
+
+    if (!proc || proc == cpu->idle || cpu->irq_current != IRQ_SYSCALL || smp_irq_depth[cpu->id]) {
+        return;
+    }
+
+    // Timer ticks are held off in the kernel context, so the time spent
+    // in it is measured with the TSC
+    used = proc->cpu_time + tsc_div(timer_cycles_to_ns(tsc_read() - cpu->acct_tsc), TIMER_NS_PER_TICK);
+
+    if (used >= proc->slice) {
+        proc->cpu_time = used;
+    } else if (!cpu->resched) {
+        return;
+    }
+
+    kernel_schedule(proc);
 }
@@ -6,6 +6,12 @@
 #include "kernel.h"
 #include "keyboard.h"
 #include "kproc.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "timer.h"
+#include "trace.h"
+#include "tsc.h"
 #include "tty.h"
 
 // Keyboard data port
@@ -58,6 +64,13 @@
 static unsigned int kbd_status = 0x0;
 static unsigned int esc_status = 0;
 
+// Scancodes taken by the handler while nested in another handler's
+// section, decoded once the section ends (keyboard_deferred)
+#define KBD_DEFERRED_MAX 16
+static unsigned int kbd_deferred_scan[KBD_DEFERRED_MAX];
+static unsigned long long kbd_deferred_tsc[KBD_DEFERRED_MAX];
+static int kbd_deferred_count = 0;
+
 // Primary keymap
 static const char keyboard_map_primary[] = {
     KEY_NULL,           /* 0x00 - Null */
@@ -237,14 +250,52 @@ static const char keyboard_map_secondary[] = {
 };
 
 
-/*
- *
+/**
+ * Decodes the scancodes received while nested in another handler
+ * Runs once the interrupted section ends (see interrupts_defer)
+ */
+static void keyboard_deferred(void) {
+    for (int i = 0; i < kbd_deferred_count; i++) {
+        unsigned int c = keyboard_decode(kbd_deferred_scan[i]);
+
+        if (c) {
+            tty_input(c, kbd_deferred_tsc[i]);
+        }
+    }
+
+    kbd_deferred_count = 0;
+}
+
+/**
+ * Keyboard IRQ handler
+ * Nested in another handler, it only takes the scancode off the
+ * controller: decoding runs hotkeys and input wakes processes, which
+ * must wait until the interrupted section ends
  */
 void keyboard_irq_handler(void) {
-    unsigned int c = keyboard_poll();
+    // Timestamp the scancode as early as possible to measure echo latency
+    unsigned long long tsc = tsc_read();
+    unsigned int c;
+
+    if (smp_cpu()->irq_depth > 0) {
+        if ((inportb(KBD_PORT_STAT) & 0x1) != 0) {
+            c = keyboard_scan();
+
+            if (kbd_deferred_count < KBD_DEFERRED_MAX) {
+                kbd_deferred_scan[kbd_deferred_count] = c;
+                kbd_deferred_tsc[kbd_deferred_count++] = tsc;
+            }
+
+            interrupts_defer(keyboard_deferred);
+        }
+
+        return;
+    }
+
+    c = keyboard_poll();
 
     if (c) {
-        tty_input(c);
+        tty_input(c, tsc);
     }
 }
 
@@ -454,6 +505,37 @@ unsigned int keyboard_decode(unsigned int c) {
                     breakpoint();
                     return KEY_NULL;
                 }
+
+                if (c == 'l' || c == 'L') {
+                    tty_latency_dump();
+                    return KEY_NULL;
+                }
+
+                if (c == 'u' || c == 'U') {
+                    scheduler_cpu_dump();
+                    timer_dump();
+                    return KEY_NULL;
+                }
+
+                if (c == 'p' || c == 'P') {
+                    profile_toggle();
+                    return KEY_NULL;
+                }
+
+                if (c == 'i' || c == 'I') {
+                    interrupts_dump();
+                    return KEY_NULL;
+                }
+
+                if (c == 't' || c == 'T') {
+                    trace_dump();
+                    return KEY_NULL;
+                }
+
+                if (c == 'k' || c == 'K') {
+                    kproc_bench(smp_get_cpu_count());
+                    return KEY_NULL;
+                }
             }
 
             if (c) {
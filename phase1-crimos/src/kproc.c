@@ -9,6 +9,7 @@
 #include <spede/string.h>
 #include <spede/machine/proc_reg.h>
 
+#include "fpu.h"
 #include "kernel.h"
 #include "trapframe.h"
 #include "kproc.h"
@@ -17,7 +18,12 @@
 #include "queue.h"
 #include "vga.h"
 #include "prog_user.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "syscall.h"
 #include "syscall_common.h"
+#include "trace.h"
+#include "uart.h"
 
 // Next available process id to be assigned
 int next_pid;
@@ -28,9 +34,21 @@ queue_t proc_allocator;
 // Process table
 proc_t proc_table[PROC_MAX];
 
+// Protects the process table and allocator
+spinlock_t proc_lock;
+
 // Process stacks
 unsigned char proc_stack[PROC_MAX][PROC_STACK_SIZE];
 
+// Process kernel stacks
+unsigned char proc_kstack[PROC_MAX][PROC_KSTACK_SIZE];
+
+// Scaling benchmark state
+int bench_pids[PROC_MAX];   // Benchmark process ids
+int bench_count;            // Number of benchmark processes running
+int bench_start;            // Tick the benchmark started at
+int bench_timer = -1;       // Timer callback that ends the benchmark
+
 /**
  * Looks up a process in the process table via the process id
  * @param pid - process id
@@ -96,8 +114,11 @@ int kproc_create(void *proc_ptr, char *proc_name, proc_type_t proc_type) {
         kernel_panic("Invalid function pointer");
     }
 
+    spin_lock(&proc_lock);
+
     // Allocate the PCB entry for the process
     if (queue_out(&proc_allocator, &proc_entry) != 0) {
+        spin_unlock(&proc_lock);
         kernel_log_warn("Unable to allocate a process entry");
         return -1;
     }
@@ -111,6 +132,9 @@ int kproc_create(void *proc_ptr, char *proc_name, proc_type_t proc_type) {
     // Point the stack to the process stack
     proc->stack = proc_stack[proc_entry];
 
+    // Kernel paths of the process run on its own kernel stack
+    proc->kstack = proc_kstack[proc_entry];
+
     // Set the process state to RUNNING
     // Initialize other process control block variables to default values
     proc->pid         = next_pid++;
@@ -123,6 +147,8 @@ int kproc_create(void *proc_ptr, char *proc_name, proc_type_t proc_type) {
     // Copy the process name to the PCB
     strncpy(proc->name, proc_name, PROC_NAME_LEN);
 
+    spin_unlock(&proc_lock);
+
     // Ensure the stack for the process is cleared
     memset(proc->stack, 0, PROC_STACK_SIZE);
 
@@ -142,6 +168,9 @@ int kproc_create(void *proc_ptr, char *proc_name, proc_type_t proc_type) {
     proc->trapframe->fs = get_fs();
     proc->trapframe->gs = get_gs();
 
+    // Processes start at the default priority
+    scheduler_set_nice(proc, 0);
+
     // Add the process to the run queue
     scheduler_add(proc);
 
@@ -162,14 +191,32 @@ int kproc_destroy(proc_t *proc) {
         return -1;
     }
 
-    if (proc->pid == 0) {
+    if (scheduler_is_idle(proc)) {
         kernel_log_error("Cannot exit the idle task");
         return -1;
     }
 
-    // Remove the process from the scheduler
+    // Remove the process from the scheduler; the state records the
+    // exit if it was running
+    proc->state = NONE;
     scheduler_remove(proc);
 
+    // A CPU whose kernel stack and accounting still belong to the process
+    // (the caller's or one it is running on) keeps using the entry until
+    // it switches to another process; its kernel_dispatch destroys it then
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+
+        if (proc == cpu->acct_proc) {
+            cpu->exited = proc;
+            smp_resched(cpu);
+            return 0;
+        }
+    }
+
+    // Give up any real-time reservation
+    scheduler_set_edf(proc, 0, 0, 0);
+
     // Clean up the process table for the process
     int entry = proc_to_entry(proc);
     if (entry < 0) {
@@ -178,6 +225,11 @@ int kproc_destroy(proc_t *proc) {
 
     kernel_log_info("Destroying process %s (%d) entry=%d", proc->name, proc->pid, entry);
 
+    // Its FPU state can no longer be restored
+    fpu_release(proc);
+
+    spin_lock(&proc_lock);
+
     // Reset the process stack
     memset(proc->stack, 0, PROC_STACK_SIZE);
 
@@ -189,11 +241,52 @@ int kproc_destroy(proc_t *proc) {
         kernel_log_warn("Unable to queue entry back into allocator");
     }
 
+    spin_unlock(&proc_lock);
+
     return 0;
 }
 
+/**
+ * Blocks the active process until kproc_wakeup is called for the event
+ * Must be called from the kernel context; returns once woken
+ * @param chan - address identifying the event
+ */
+void kproc_block(void *chan) {
+    proc_t *proc = active_proc;
+
+    if (!proc || scheduler_is_idle(proc)) {
+        kernel_panic("Unable to block the active process");
+    }
+
+    trace_event(TRACE_BLOCK, proc->pid, (unsigned int)chan);
+
+    proc->wait_chan = chan;
+    proc->state = BLOCKED;
+    scheduler_remove(proc);
+
+    kernel_schedule(proc);
+
+    proc->wait_chan = NULL;
+}
+
+/**
+ * Wakes up every process blocked on the given event
+ * @param chan - address identifying the event
+ */
+void kproc_wakeup(void *chan) {
+    for (int i = 0; i < PROC_MAX; i++) {
+        proc_t *proc = &proc_table[i];
+
+        if (proc->state == BLOCKED && proc->wait_chan == chan) {
+            proc->wait_chan = NULL;
+            scheduler_add(proc);
+        }
+    }
+}
+
 /**
  * Idle Process
+ * Each CPU runs its own instance
  */
 void kproc_idle(void) {
     while (1) {
@@ -205,6 +298,18 @@ void kproc_idle(void) {
     }
 }
 
+/**
+ * Kernel log process
+ * Prints the queued kernel log messages at the lowest priority so that
+ * logging never stalls interrupt or scheduling paths
+ */
+void kproc_log(void) {
+    while (1) {
+        kernel_log_drain();
+        sys_log_wait();
+    }
+}
+
 /**
  * Test process
  */
@@ -213,6 +318,86 @@ void kproc_test(void) {
     while (1);
 }
 
+/**
+ * Completes the scaling benchmark once KPROC_BENCH_MS have passed
+ * Runs every tick; reports how many CPUs' worth of work the test
+ * processes received
+ */
+void kproc_bench_end(void) {
+    int elapsed = timer_get_ticks() - bench_start;
+    int run_time = 0;
+
+    if (elapsed < TIMER_MS_TO_TICKS(KPROC_BENCH_MS)) {
+        return;
+    }
+
+    timer_callback_unregister(bench_timer);
+    bench_timer = -1;
+
+    for (int i = 0; i < bench_count; i++) {
+        proc_t *proc = pid_to_proc(bench_pids[i]);
+
+        if (proc) {
+            run_time += proc->run_time;
+            kproc_destroy(proc);
+        }
+    }
+
+    // Speedup relative to a single CPU (x100), ideally min(count, CPUs) * 100
+    kernel_log_info("bench: %d processes on %d CPUs: %d ticks of work in %d ticks, speedup=%d.%02d",
+                    bench_count, smp_get_cpu_count(), run_time, elapsed,
+                    elapsed ? run_time / elapsed : 0,
+                    elapsed ? (run_time * 100 / elapsed) % 100 : 0);
+    scheduler_cpu_dump();
+
+    bench_count = 0;
+}
+
+/**
+ * Runs the scaling benchmark
+ * Starts CPU-bound test processes and measures the aggregate CPU time
+ * they receive over KPROC_BENCH_MS
+ * @param count - number of test processes to start
+ * @return 0 on success, -1 on error
+ */
+int kproc_bench(int count) {
+    if (bench_count) {
+        kernel_log_warn("bench: already running");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int pid = kproc_create(kproc_test, "bench", PROC_TYPE_USER);
+
+        if (pid < 0) {
+            break;
+        }
+
+        bench_pids[bench_count++] = pid;
+    }
+
+    if (!bench_count) {
+        return -1;
+    }
+
+    bench_start = timer_get_ticks();
+    // Timer intervals are aligned to multiples of the interval rather than
+    // to the time of registration, so the elapsed time is checked each tick
+    bench_timer = timer_callback_register(kproc_bench_end, 1, -1);
+
+    if (bench_timer < 0) {
+        for (int i = 0; i < bench_count; i++) {
+            kproc_destroy(pid_to_proc(bench_pids[i]));
+        }
+
+        bench_count = 0;
+        return -1;
+    }
+
+    kernel_log_info("bench: started %d test processes for %d ms", bench_count, KPROC_BENCH_MS);
+    return 0;
+}
+
 /**
  * Attaches a process to a TTY
  * Points the input / output buffers to the TTY's input/output buffers
@@ -260,8 +445,21 @@ void kproc_init(void) {
     // Create/execute the idle process (kproc_idle)
     pid = kproc_create(kproc_idle, "idle", PROC_TYPE_KERNEL);
 
+    // The idle process is only run when the CPU has nothing else to do
+    smp_get_cpu(0)->idle = pid_to_proc(pid);
+    scheduler_remove(smp_get_cpu(0)->idle);
+
     kernel_log_info("Created idle process %d", pid);
 
+    // Create the kernel log process
+    if (KERNEL_LOG_DEFERRED) {
+        pid = kproc_create(kproc_log, "klog", PROC_TYPE_KERNEL);
+
+        if (pid != -1) {
+            scheduler_set_nice(pid_to_proc(pid), SCHEDULER_NICE_MAX);
+        }
+    }
+
     // Create 4 instances of the program shell and attach to individual tty's 
      for (int i = 0; i < 4; i++) {
         // Create a user process with a pointer to a program shell
@@ -273,6 +471,15 @@ void kproc_init(void) {
         }
     }
 
+    // Give the serial port its own shell
+    if (uart_present()) {
+        pid = kproc_create(prog_shell, "shell", PROC_TYPE_USER);
+
+        if (pid != -1) {
+            kproc_attach_tty(pid, UART_TTY);
+        }
+    }
+
 
 }
 
@@ -14,63 +14,212 @@
 #include "interrupts.h"
 #include "scheduler.h"
 #include "timer.h"
+#include "trace.h"
+#include "tsc.h"
+#include "tty.h"
 
 /**
- * System call IRQ handler
- * Dispatches system calls to the function associate with the specified system call
+ * Dispatches a system call to the function associated with its identifier
+ * System call identifier is stored on the EAX register
+ * Additional arguments are stored on additional registers (EBX, ECX, etc.)
+ * The return value is stored on the EAX register
+ * @param trapframe - pointer to the calling process' trapframe
  */
-void ksyscall_irq_handler(void) {
+static void ksyscall_dispatch(trapframe_t *trapframe) {
     // Default return value
     int rc = -1;
 
-    if (!active_proc) {
-        kernel_panic("Invalid process");
+    if (trapframe->eax == SYSCALL_IO_READ) {
+        rc = ksyscall_io_read(trapframe->ebx,
+                              (char *)trapframe->ecx,
+                              trapframe->edx);
+        trapframe->eax = rc;
+        return;
     }
 
-    if (!active_proc->trapframe) {
-        kernel_panic("Invalid trapframe");
+    if (trapframe->eax == SYSCALL_IO_WRITE) {
+        rc = ksyscall_io_write(trapframe->ebx,
+                               (char *)trapframe->ecx,
+                               trapframe->edx);
+        trapframe->eax = rc;
+        return;
     }
 
-    // System call identifier is stored on the EAX register
-    // Additional arguments should be stored on additional registers (EBX, ECX, etc.)
-
-    // Based upon the system call identifier, call the respective system call handler
-
-    // Ensure that the EAX register for the active process contains the return value
+    if (trapframe->eax == SYSCALL_IO_FLUSH) {
+        rc = ksyscall_io_flush(trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
 
-     if (active_proc->trapframe->eax == SYSCALL_SYS_GET_TIME) {
+    if (trapframe->eax == SYSCALL_SYS_GET_TIME) {
         rc = ksyscall_sys_get_time();
-        active_proc->trapframe->eax = rc;
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_SYS_GET_TIME_NS) {
+        // Cast the argument as a 64-bit integer pointer
+        rc = ksyscall_sys_get_time_ns((unsigned long long *)trapframe->ebx);
+        trapframe->eax = rc;
         return;
     }
 
-    if (active_proc->trapframe->eax == SYSCALL_SYS_GET_NAME) {
+    if (trapframe->eax == SYSCALL_SYS_GET_NAME) {
         // Cast the argument as a char pointer
-        rc = ksyscall_sys_get_name((char *)active_proc->trapframe->ebx);
-        active_proc->trapframe->eax = rc;
+        rc = ksyscall_sys_get_name((char *)trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_SYS_GET_LATENCY) {
+        // Cast the argument as a latency statistics pointer
+        rc = ksyscall_sys_get_latency((latency_stat_t *)trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_SYS_GET_LOAD) {
+        // Cast the argument as a load summary pointer
+        rc = ksyscall_sys_get_load((sys_load_t *)trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_SYS_LOG_SITE) {
+        rc = ksyscall_sys_log_site(trapframe->ebx, trapframe->ecx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_SYS_LOG_READ) {
+        rc = ksyscall_sys_log_read((unsigned int *)trapframe->ebx,
+                                   (char *)trapframe->ecx,
+                                   trapframe->edx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_SYS_IRQ_STAT) {
+        // Cast the second argument as an interrupt summary pointer
+        rc = ksyscall_sys_irq_stat(trapframe->ebx, (irq_stat_t *)trapframe->ecx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_SYS_LOG_WAIT) {
+        rc = ksyscall_sys_log_wait();
+        trapframe->eax = rc;
         return;
     }
 
-    if (active_proc->trapframe->eax == SYSCALL_PROC_EXIT) {
+    if (trapframe->eax == SYSCALL_PROC_SLEEP) {
+        rc = ksyscall_proc_sleep(trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_SLEEP_NS) {
+        // The 64-bit argument is split across two registers (low, high)
+        rc = ksyscall_proc_sleep_ns(((unsigned long long)trapframe->ecx << 32) | trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_SLEEP_UNTIL) {
+        // The 64-bit argument is split across two registers (low, high)
+        rc = ksyscall_proc_sleep_until(((unsigned long long)trapframe->ecx << 32) | trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_STAT) {
+        // Cast the second argument as a process statistics pointer
+        rc = ksyscall_proc_stat(trapframe->ebx, (proc_stat_t *)trapframe->ecx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_EXIT) {
         rc = ksyscall_proc_exit();
-        active_proc->trapframe->eax = rc;
+        trapframe->eax = rc;
         return;
     }
 
-    if (active_proc->trapframe->eax == SYSCALL_PROC_GET_PID) {
+    if (trapframe->eax == SYSCALL_PROC_GET_PID) {
         rc = ksyscall_proc_get_pid();
-        active_proc->trapframe->eax = rc;
+        trapframe->eax = rc;
         return;
     }
 
-    if (active_proc->trapframe->eax == SYSCALL_PROC_GET_NAME) {
+    if (trapframe->eax == SYSCALL_PROC_GET_NAME) {
         // Cast the argument as a char pointer
-        rc = ksyscall_proc_get_name((char *)active_proc->trapframe->ebx);
-        active_proc->trapframe->eax = rc;
+        rc = ksyscall_proc_get_name((char *)trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_SET_NICE) {
+        rc = ksyscall_proc_set_nice(trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_SET_EDF) {
+        rc = ksyscall_proc_set_edf(trapframe->ebx, trapframe->ecx, trapframe->edx);
+        trapframe->eax = rc;
         return;
     }
 
-    kernel_panic("Invalid system call %d!", active_proc->trapframe->eax);
+    if (trapframe->eax == SYSCALL_PROC_EDF_WAIT) {
+        rc = ksyscall_proc_edf_wait();
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_YIELD) {
+        rc = ksyscall_proc_yield();
+        trapframe->eax = rc;
+        return;
+    }
+
+    if (trapframe->eax == SYSCALL_PROC_YIELD_TO) {
+        rc = ksyscall_proc_yield_to(trapframe->ebx);
+        trapframe->eax = rc;
+        return;
+    }
+
+    kernel_panic("Invalid system call %d!", trapframe->eax);
+}
+
+/**
+ * System call IRQ handler
+ * Dispatches system calls to the function associate with the specified system call
+ */
+void ksyscall_irq_handler(void) {
+    proc_t *proc = active_proc;
+    trapframe_t *trapframe;
+    int pid;
+
+    if (!proc) {
+        kernel_panic("Invalid process");
+        return;
+    }
+
+    if (!proc->trapframe) {
+        kernel_panic("Invalid trapframe");
+        return;
+    }
+
+    // Handlers may reschedule (sleep, exit), so the trapframe and process
+    // id are captured up front
+    trapframe = proc->trapframe;
+    pid = proc->pid;
+
+    trace_event(TRACE_SYSCALL_ENTER, pid, trapframe->eax);
+
+    ksyscall_dispatch(trapframe);
+
+    trace_event(TRACE_SYSCALL_EXIT, pid, trapframe->eax);
 }
 
 /**
@@ -78,8 +227,8 @@ void ksyscall_irq_handler(void) {
  */
 void ksyscall_init(void) {
     // Register the IDT entry and IRQ handler for the syscall IRQ (IRQ_SYSCALL)
-    // Initialize interrupts to register the syscall IRQ handler
-    interrupts_init();
+    // Interrupts were initialized in main; re-initializing would drop the
+    // timer and keyboard handlers that were already registered
 
     // Register the syscall IRQ handler
     interrupts_irq_register(IRQ_SYSCALL, isr_entry_syscall, ksyscall_irq_handler);
@@ -93,9 +242,10 @@ void ksyscall_init(void) {
  * @return -1 on error or value indicating number of bytes copied
  */
 int ksyscall_io_write(int io, char *buf, int size) {
+    proc_t *proc = active_proc;
 
     // Ensure there is an active process
-    if (!active_proc) {
+    if (!proc) {
         return -1;
     }
 
@@ -105,25 +255,50 @@ int ksyscall_io_write(int io, char *buf, int size) {
     }
 
     // Ensure that the active process has a valid IO buffer
-    if (!active_proc->io[io]) {
+    if (!proc->io[io]) {
         return -1;
     }
 
-    // Using ringbuf_write_mem - Write size bytes from buf to active_proc->io[io]
-    return ringbuf_write_mem(active_proc->io[io], buf, size);
+    // The whole write must fit (ringbuf_write_mem does not write partially)
+    if (size < 0 || size > RINGBUF_SIZE - proc->io[io]->size) {
+        return -1;
+    }
+
+    // Copy in chunks with a preemption point in between; the buffer
+    // can only fill up meanwhile if another process writes to it
+    for (int done = 0; done < size; done += KSYSCALL_IO_CHUNK) {
+        int chunk = size - done;
+
+        if (chunk > KSYSCALL_IO_CHUNK) {
+            chunk = KSYSCALL_IO_CHUNK;
+        }
+
+        if (done > 0) {
+            kernel_preempt();
+        }
+
+        // Using ringbuf_write_mem - Write the chunk from buf to proc->io[io]
+        if (ringbuf_write_mem(proc->io[io], buf + done, chunk) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
 /**
  * Reads up to n bytes from the process' specified IO buffer
+ * Reading the input buffer blocks until at least one byte is available
  * @param io - the IO buffer to read from
  * @param buf - the buffer to copy to
  * @param n - number of bytes to read
  * @return -1 on error or value indicating number of bytes copied
  */
 int ksyscall_io_read(int io, char *buf, int size) {
+    proc_t *proc = active_proc;
 
     // Ensure there is an active process
-    if (!active_proc) {
+    if (!proc) {
         return -1;
     }
 
@@ -133,12 +308,40 @@ int ksyscall_io_read(int io, char *buf, int size) {
     }
 
     // Ensure that the active process has a valid IO buffer
-    if (!active_proc->io[io]) {
+    if (!proc->io[io]) {
         return -1;
     }
 
-    // Using ringbuf_read_mem - Read size bytes from active_proc->io[io] to buf
-    return ringbuf_read_mem(active_proc->io[io], buf, size);
+    // Wait for input instead of returning empty-handed
+    while (io == PROC_IO_IN && size > 0 && ringbuf_is_empty(proc->io[io])) {
+        kproc_block(proc->io[io]);
+    }
+
+    // Copy in chunks with a preemption point in between
+    int count = 0;
+
+    while (count < size) {
+        int chunk = size - count;
+        int n;
+
+        if (chunk > KSYSCALL_IO_CHUNK) {
+            chunk = KSYSCALL_IO_CHUNK;
+        }
+
+        if (count > 0) {
+            kernel_preempt();
+        }
+
+        // Using ringbuf_read_mem - Read the chunk from proc->io[io] to buf
+        n = ringbuf_read_mem(proc->io[io], buf + count, chunk);
+        count += n;
+
+        if (n < chunk) {
+            break;
+        }
+    }
+
+    return count;
 }
 
 /**
@@ -147,9 +350,10 @@ int ksyscall_io_read(int io, char *buf, int size) {
  * @return -1 on error or 0 on success
  */
 int ksyscall_io_flush(int io) {
+    proc_t *proc = active_proc;
 
     // Ensure there is an active process
-    if (!active_proc) {
+    if (!proc) {
         return -1;
     }
 
@@ -159,12 +363,12 @@ int ksyscall_io_flush(int io) {
     }
 
     // Ensure that the active process has a valid IO buffer
-    if (!active_proc->io[io]) {
+    if (!proc->io[io]) {
         return -1;
     }
 
     // Use ringbuf_flush to flush the IO buffer
-    ringbuf_flush(active_proc->io[io]);
+    ringbuf_flush(proc->io[io]);
     return 0;
 }
 
@@ -173,7 +377,21 @@ int ksyscall_io_flush(int io) {
  * @return system time in seconds
  */
 int ksyscall_sys_get_time(void) {
-    return timer_get_ticks() / 100;
+    return TIMER_TICKS_TO_SEC(timer_get_ticks());
+}
+
+/**
+ * Gets the current system time (in nanoseconds)
+ * @param ns - pointer to where the time will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int ksyscall_sys_get_time_ns(unsigned long long *ns) {
+    if (!ns) {
+        return -1;
+    }
+
+    *ns = kernel_clock_ns();
+    return 0;
 }
 
 /**
@@ -190,48 +408,200 @@ int ksyscall_sys_get_name(char *name) {
     return 0;
 }
 
+/**
+ * Gets the keystroke-to-echo latency statistics
+ * @param stat - pointer to the structure where the statistics will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int ksyscall_sys_get_latency(latency_stat_t *stat) {
+    return tty_latency_get(stat);
+}
+
+/**
+ * Gets the system load summary
+ * @param load - pointer to the structure where the summary will be copied
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_sys_get_load(sys_load_t *load) {
+    return scheduler_load_get(load);
+}
+
+/**
+ * Enables or disables a kernel log call site, or lists the call sites
+ * on the host console
+ * @param index - call site number, -1 for every call site
+ * @param enabled - 1 to enable, 0 to disable, -1 to list the call sites
+ * @return 0 on success, -1 if there is no such call site
+ */
+int ksyscall_sys_log_site(int index, int enabled) {
+    if (enabled < 0) {
+        kernel_log_site_dump();
+        return 0;
+    }
+
+    return kernel_log_site_enable(index, enabled != 0);
+}
+
+/**
+ * Reads kernel log messages, formatted as text lines ("<seq> <level>: <message>")
+ * Pass the sequence number back in to continue where the last read ended
+ * @param seq - in: sequence number of the first message to read (0 for the
+ *              oldest message kept), out: sequence number to continue from
+ * @param buf - buffer to copy the messages to
+ * @param n - size of the buffer
+ * @return number of bytes copied, -1 on error
+ */
+int ksyscall_sys_log_read(unsigned int *seq, char *buf, int n) {
+    if (!seq || !buf || n <= 0) {
+        return -1;
+    }
+
+    return kernel_log_read(seq, buf, n);
+}
+
+/**
+ * Blocks the active process until kernel log messages are queued
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_sys_log_wait(void) {
+    if (!active_proc) {
+        return -1;
+    }
+
+    kernel_log_wait();
+    return 0;
+}
+
+/**
+ * Obtains the statistics for an interrupt vector
+ * @param irq - interrupt vector
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 if the vector is invalid or has no handler
+ */
+int ksyscall_sys_irq_stat(int irq, irq_stat_t *stat) {
+    return interrupts_irq_stat(irq, stat);
+}
+
 /**
  * Puts the active process to sleep for the specified number of seconds
  * @param seconds - number of seconds the process should sleep
  */
 int ksyscall_proc_sleep(int seconds) {
-     if (!active_proc) {
+    proc_t *proc = active_proc;
+
+     if (!proc) {
         return -1;
     }
 
     // Put the active process to sleep for the specified number of seconds
-    scheduler_sleep(active_proc, seconds * 100); // Convert seconds to ticks
+    scheduler_sleep(proc, seconds * TIMER_HZ); // Convert seconds to ticks
 
     return 0;
 }
 
 /**
- * Exits the current process
+ * Puts the active process to sleep for the specified number of nanoseconds
+ * The process becomes runnable at the first timer tick at or after the time
+ * @param ns - number of nanoseconds the process should sleep
+ * @return 0 on success, -1 on error
  */
-int ksyscall_proc_exit(void) {
-    if (!active_proc) {
-        return -1; // No active process
+int ksyscall_proc_sleep_ns(unsigned long long ns) {
+    return ksyscall_proc_sleep_until(kernel_clock_ns() + ns);
+}
+
+/**
+ * Puts the active process to sleep until the kernel clock reaches the
+ * specified time
+ * The process becomes runnable at the first timer tick at or after the
+ * time, never before it. It runs right away if it preempts the running
+ * process (see scheduler_add), otherwise when that process' slice ends.
+ * Periodic processes that advance an absolute deadline do not drift
+ * @param ns - kernel clock time (see sys_get_time_ns) to sleep until
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_proc_sleep_until(unsigned long long ns) {
+    proc_t *proc = active_proc;
+
+    if (!proc) {
+        return -1;
+    }
+
+    // A deadline that has already passed does not sleep
+    if (ns > kernel_clock_ns()) {
+        scheduler_sleep(proc, timer_ns_to_tick(ns) - timer_get_ticks());
+    }
+
+    return 0;
+}
+
+/**
+ * Converts TSC cycles to whole microseconds, saturating
+ * @param cycles - number of cycles
+ * @return microseconds
+ */
+static unsigned int ksyscall_cycles_to_us(unsigned long long cycles) {
+    unsigned long long ns = timer_cycles_to_ns(cycles);
+
+    if (ns >= 1000ULL * 0xffffffff) {
+        return 0xffffffff;
     }
 
-    // Set the process state to NONE to indicate it has exited
-    active_proc->state = NONE;
+    return tsc_div(ns, 1000);
+}
+
+/**
+ * Copies the accounting statistics of a process
+ * @param pid - process id
+ * @param stat - pointer to the statistics to fill in
+ * @return 0 on success, -1 if there is no such process
+ */
+int ksyscall_proc_stat(int pid, proc_stat_t *stat) {
+    proc_t *proc = pid_to_proc(pid);
+
+    if (!proc || !stat) {
+        return -1;
+    }
 
-    // Reschedule by running the scheduler
-    scheduler_run();
+    stat->pid = proc->pid;
+    stat->run_ticks = proc->run_time;
+    stat->user_cycles = proc->user_cycles;
+    stat->kernel_cycles = proc->kernel_cycles;
+    stat->user_us = ksyscall_cycles_to_us(proc->user_cycles);
+    stat->kernel_us = ksyscall_cycles_to_us(proc->kernel_cycles);
+    stat->switches_voluntary = proc->switches_voluntary;
+    stat->switches_involuntary = proc->switches_involuntary;
+    stat->wakeups = proc->wakeups;
 
     return 0;
 }
 
+/**
+ * Exits the current process
+ */
+int ksyscall_proc_exit(void) {
+    proc_t *proc = active_proc;
+
+    if (!proc) {
+        return -1; // No active process
+    }
+
+    // Release the process; the kernel path finishes on its kernel
+    // stack, which kernel_dispatch leaves before destroying the entry
+    return kproc_destroy(proc);
+}
+
 /**
  * Gets the active process pid
  * @return process id or -1 on error
  */
 int ksyscall_proc_get_pid(void) {
-    if (!active_proc) {
+    proc_t *proc = active_proc;
+
+    if (!proc) {
         return -1; // No active process
     }
 
-    return active_proc->pid;
+    return proc->pid;
 }
 
 /**
@@ -240,12 +610,97 @@ int ksyscall_proc_get_pid(void) {
  * @return 0 on success, -1 or other non-zero value on error
  */
 int ksyscall_proc_get_name(char *name) {
-     if (!active_proc || !name) {
+    proc_t *proc = active_proc;
+
+    if (!proc || !name) {
         return -1; // No active process or invalid name pointer
     }
 
     // Copy the process name to the provided buffer
-    strncpy(name, active_proc->name, PROC_NAME_LEN);
+    strncpy(name, proc->name, PROC_NAME_LEN);
+
+    return 0;
+}
+
+/**
+ * Sets the active process' nice value
+ * @param nice - nice value (-20 highest to 19 lowest priority)
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int ksyscall_proc_set_nice(int nice) {
+    proc_t *proc = active_proc;
+
+    if (!proc) {
+        return -1; // No active process
+    }
+
+    return scheduler_set_nice(proc, nice);
+}
+
+/**
+ * Makes the active process a periodic real-time (EDF) process
+ * @param period_ms - period in milliseconds, 0 to return to the fair class
+ * @param budget_ms - execution budget per period in milliseconds
+ * @param deadline_ms - relative deadline in milliseconds, 0 to use the period
+ * @return 0 on success, -1 if the parameters are invalid or admission fails
+ */
+int ksyscall_proc_set_edf(int period_ms, int budget_ms, int deadline_ms) {
+    proc_t *proc = active_proc;
+
+    if (!proc || period_ms < 0 || budget_ms < 0 || deadline_ms < 0) {
+        return -1;
+    }
+
+    return scheduler_set_edf(proc,
+                             TIMER_MS_TO_TICKS(period_ms),
+                             TIMER_MS_TO_TICKS(budget_ms),
+                             TIMER_MS_TO_TICKS(deadline_ms));
+}
+
+/**
+ * Ends the current job of the active real-time process
+ * @return 0 on success, -1 if the process is not a real-time process
+ */
+int ksyscall_proc_edf_wait(void) {
+    proc_t *proc = active_proc;
+
+    if (!proc || proc->sched_class != SCHED_CLASS_EDF) {
+        return -1;
+    }
+
+    scheduler_edf_complete(proc);
+    return 0;
+}
+
+/**
+ * Gives up the rest of the active process' time slice
+ * @return 0 on success, -1 on error
+ */
+int ksyscall_proc_yield(void) {
+    proc_t *proc = active_proc;
+
+    if (!proc) {
+        return -1;
+    }
+
+    scheduler_yield(proc, NULL);
+    return 0;
+}
+
+/**
+ * Gives the rest of the active process' time slice to another process
+ * If the target is not waiting to run, this is the same as a plain yield
+ * @param pid - process id of the process to donate to
+ * @return 0 on success, -1 if there is no such process
+ */
+int ksyscall_proc_yield_to(int pid) {
+    proc_t *proc = active_proc;
+    proc_t *target = pid_to_proc(pid);
+
+    if (!proc || !target) {
+        return -1;
+    }
 
+    scheduler_yield(proc, target);
     return 0;
 }
@@ -7,15 +7,18 @@
  */
 
 #include <spede/stdbool.h>
+#include "fpu.h"
 #include "interrupts.h"
 #include "kernel.h"
 #include "keyboard.h"
 #include "timer.h"
 #include "tty.h"
+#include "uart.h"
 #include "vga.h"
 #include "scheduler.h"
 #include "kproc.h"
 #include "ksyscall.h"
+#include "smp.h"
 #include "test.h"
 
 int main(void) {
@@ -25,6 +28,9 @@ int main(void) {
     // Initialize interrupts
     interrupts_init();
 
+    // Initialize lazy FPU/SSE switching
+    fpu_init();
+
     // Initialize timers
     timer_init();
 
@@ -37,6 +43,9 @@ int main(void) {
     // Initialize the keyboard driver
     keyboard_init();
 
+    // Initialize the serial port driver
+    uart_init();
+
     // Initialize the scheduler
     scheduler_init();
 
@@ -61,6 +70,9 @@ int main(void) {
     // Clear the screen
     vga_clear();
 
+    // Start the other CPUs
+    smp_init();
+
     // Enable interrupts
     interrupts_enable();
 
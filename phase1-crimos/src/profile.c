@@ -0,0 +1,109 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Sampling Profiler
+ *
+ * Every timer interrupt, the instruction pointer of the interrupted
+ * process is counted in a histogram keyed by (eip, pid). The sampling
+ * rate is the timer rate; build with a higher TIMER_HZ for finer
+ * profiles. The kernel context runs with interrupts disabled, so kernel
+ * time shows up in kernel processes (such as the idle process) only.
+ */
+#include <spede/stdio.h>
+#include <spede/string.h>
+
+#include "kernel.h"
+#include "kproc.h"
+#include "profile.h"
+
+// Sample histogram (open addressing, linear probing)
+profile_entry_t profile_table[PROFILE_SIZE];
+
+// Indicates if samples are being taken
+int profile_running = 0;
+
+// Number of samples taken, and dropped because the histogram was full
+unsigned int profile_samples = 0;
+unsigned int profile_dropped = 0;
+
+/**
+ * Records a sample of the process interrupted by the timer
+ * @param proc - pointer to the interrupted process entry
+ */
+void profile_sample(proc_t *proc) {
+    unsigned int eip;
+    unsigned int i;
+
+    if (!PROFILE || !profile_running || !proc || !proc->trapframe) {
+        return;
+    }
+
+    eip = proc->trapframe->eip;
+    profile_samples++;
+
+    // Look for the entry of this (eip, pid) or the first free one
+    i = (eip ^ (eip >> 10) ^ (proc->pid * 0x9e37)) & (PROFILE_SIZE - 1);
+
+    for (int n = 0; n < PROFILE_SIZE; n++, i = (i + 1) & (PROFILE_SIZE - 1)) {
+        profile_entry_t *entry = &profile_table[i];
+
+        if (!entry->used) {
+            entry->used = 1;
+            entry->eip = eip;
+            entry->pid = proc->pid;
+            entry->kernel = (proc->type == PROC_TYPE_KERNEL);
+            entry->count = 1;
+            return;
+        }
+
+        if (entry->eip == eip && entry->pid == proc->pid) {
+            entry->count++;
+            return;
+        }
+    }
+
+    profile_dropped++;
+}
+
+/**
+ * Starts the profiler with an empty histogram, or stops it and prints the
+ * histogram to the host console if it is running
+ */
+void profile_toggle(void) {
+    if (!PROFILE) {
+        kernel_log_warn("profile: not built (PROFILE=0)");
+        return;
+    }
+
+    if (profile_running) {
+        profile_running = 0;
+        profile_dump();
+        return;
+    }
+
+    memset(profile_table, 0, sizeof(profile_table));
+    profile_samples = 0;
+    profile_dropped = 0;
+    profile_running = 1;
+
+    kernel_log_info("profile: started");
+}
+
+/**
+ * Prints the histogram to the host console
+ * One line per entry: "P <eip> <pid> <K|U> <count>"; the addresses can be
+ * looked up in the disassembly generated by `make text`
+ */
+void profile_dump(void) {
+    kernel_log_info("profile: samples=%u dropped=%u", profile_samples, profile_dropped);
+
+    for (int i = 0; i < PROFILE_SIZE; i++) {
+        profile_entry_t *entry = &profile_table[i];
+
+        if (entry->used) {
+            printf("P %08x %d %c %u\n", entry->eip, entry->pid,
+                   entry->kernel ? 'K' : 'U', entry->count);
+        }
+    }
+}
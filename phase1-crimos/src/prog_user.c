@@ -19,9 +19,16 @@
     } \
 }
 
+#define CMD_DMESG "dmesg"
 #define CMD_EXIT "exit"
 #define CMD_HELP "help"
+#define CMD_IRQ "irq"
+#define CMD_LATENCY "latency"
+#define CMD_LOAD "load"
+#define CMD_LOGSITE "logsite"
+#define CMD_NICE "nice"
 #define CMD_SLEEP "sleep"
+#define CMD_STAT "stat"
 #define CMD_TIME "time"
 
 void prog_shell(void) {
@@ -69,6 +76,12 @@ void prog_shell(void) {
         while (reading) {
             buflen = io_read(PROC_IO_IN, buf, BUF_SIZE);
 
+            // Nothing to read (e.g. no TTY attached): let others run
+            if (buflen <= 0) {
+                proc_yield();
+                continue;
+            }
+
             for (int i = 0; i < buflen; i++) {
                 if (buf[i] == '\n' || buf[i] == 0) {
                     io_write(PROC_IO_OUT, &buf[i], 1);
@@ -83,16 +96,134 @@ void prog_shell(void) {
         if (input_len) {
             if (strncmp(input, CMD_HELP, strlen(CMD_HELP)) == 0) {
                 pprintf("Enter one of the following commands:\n");
+                pprintf("\tdmesg\t  displays the kernel log\n");
                 pprintf("\texit\t  exits the process\n");
+                pprintf("\tirq\t  displays the interrupt counts and handler times\n");
+                pprintf("\tlatency\t  displays the keystroke-to-echo latency\n");
+                pprintf("\tload\t  displays the system load averages\n");
+                pprintf("\tlogsite [N 0|1]  lists kernel log sites, or turns site N (-1: all) off/on\n");
+                pprintf("\tnice N\t  sets the priority of the process (-20 to 19)\n");
                 pprintf("\tsleep\t  puts the process to sleep for %d seconds\n", sleep_seconds);
+                pprintf("\tstat\t  displays the CPU time and switches of the process\n");
                 pprintf("\ttime\t  displays the current system time\n");
                 pprintf("\n");
             } else if(strncmp(input, CMD_SLEEP, strlen(CMD_SLEEP)) == 0) {
                 pprintf("Sleeping for %d seconds at time %d ... ", sleep_seconds, sys_get_time());
                 proc_sleep(sleep_seconds);
                 pprintf("... and awake at time %d!\n", sys_get_time());
+            } else if (strncmp(input, CMD_STAT, strlen(CMD_STAT)) == 0) {
+                proc_stat_t stat;
+
+                if (proc_stat(pid, &stat) == 0) {
+                    pprintf("User: %u us Kernel: %u us Ticks: %d\n",
+                            stat.user_us, stat.kernel_us, stat.run_ticks);
+                    pprintf("Switches: %u voluntary %u involuntary Wakeups: %u\n",
+                            stat.switches_voluntary, stat.switches_involuntary, stat.wakeups);
+                }
+            } else if (strncmp(input, CMD_DMESG, strlen(CMD_DMESG)) == 0) {
+                char log[256];
+                unsigned int seq = 0;
+                int len;
+
+                // Read the kernel log a buffer at a time
+                while ((len = sys_log_read(&seq, log, sizeof(log))) > 0) {
+                    io_write(PROC_IO_OUT, log, len);
+                }
+            } else if (strncmp(input, CMD_IRQ, strlen(CMD_IRQ)) == 0) {
+                irq_stat_t stat;
+                unsigned int off_max_ns = 0;
+
+                pprintf("IRQ       Count   Avg ns   P99 ns   Max ns\n");
+
+                for (int irq = 0; irq < 0x100; irq++) {
+                    if (sys_irq_stat(irq, &stat) != 0) {
+                        continue;
+                    }
+
+                    off_max_ns = stat.off_max_ns;
+
+                    if (stat.count) {
+                        pprintf("0x%02x %10u %8u %8u %8u\n",
+                                irq, stat.count, stat.avg_ns, stat.p99_ns, stat.max_ns);
+                    }
+                }
+
+                pprintf("Longest interrupts-off window: %u ns\n", off_max_ns);
             } else if (strncmp(input, CMD_TIME, strlen(CMD_TIME)) == 0) {
                 pprintf("The current time is %d seconds\n", sys_get_time());
+            } else if (strncmp(input, CMD_LATENCY, strlen(CMD_LATENCY)) == 0) {
+                latency_stat_t stat;
+
+                if (sys_get_latency(&stat) == 0) {
+                    pprintf("Keystrokes: %u p50: %u p99: %u max: %u cycles\n",
+                            stat.count, stat.p50, stat.p99, stat.max);
+                }
+            } else if (strncmp(input, CMD_LOAD, strlen(CMD_LOAD)) == 0) {
+                sys_load_t load;
+
+                if (sys_get_load(&load) == 0) {
+                    pprintf("Load: %u.%02u %u.%02u %u.%02u Idle: %u%%\n",
+                            load.load[0] / 100, load.load[0] % 100,
+                            load.load[1] / 100, load.load[1] % 100,
+                            load.load[2] / 100, load.load[2] % 100, load.idle_pct);
+                    pprintf("Run queue: %d (max %d) CPUs: %d Processes: %d/%d\n",
+                            load.run_queue, load.run_queue_max, load.cpus, load.procs, load.procs_max);
+                }
+            } else if (strncmp(input, CMD_LOGSITE, strlen(CMD_LOGSITE)) == 0) {
+                char *arg = input + strlen(CMD_LOGSITE);
+                int sign = 1;
+                int index = 0;
+
+                while (*arg == ' ') {
+                    arg++;
+                }
+
+                if (*arg == 0) {
+                    sys_log_site(-1, -1);
+                    pprintf("Kernel log sites listed on the host console\n");
+                } else {
+                    if (*arg == '-') {
+                        sign = -1;
+                        arg++;
+                    }
+
+                    while (*arg >= '0' && *arg <= '9') {
+                        index = index * 10 + (*arg++ - '0');
+                    }
+
+                    while (*arg == ' ') {
+                        arg++;
+                    }
+
+                    if (sys_log_site(sign * index, *arg == '1') == 0) {
+                        pprintf("Log site %d turned %s\n", sign * index, *arg == '1' ? "on" : "off");
+                    } else {
+                        pprintf("Invalid log site\n");
+                    }
+                }
+            } else if (strncmp(input, CMD_NICE, strlen(CMD_NICE)) == 0) {
+                char *arg = input + strlen(CMD_NICE);
+                int sign = 1;
+                int nice = 0;
+
+                while (*arg == ' ') {
+                    arg++;
+                }
+
+                if (*arg == '-') {
+                    sign = -1;
+                    arg++;
+                }
+
+                while (*arg >= '0' && *arg <= '9') {
+                    nice = nice * 10 + (*arg++ - '0');
+                }
+
+                if (proc_set_nice(sign * nice) == 0) {
+                    pprintf("Nice value set to %d\n", sign * nice);
+                } else {
+                    pprintf("Invalid nice value\n");
+                }
             } else if (strncmp(input, CMD_EXIT, strlen(CMD_EXIT)) == 0) {
                 pprintf("Exiting process id %d\n", pid);
                 proc_exit(0);
@@ -13,23 +13,620 @@
 #include "kernel.h"
 #include "kproc.h"
 #include "scheduler.h"
+#include "smp.h"
 #include "timer.h"
+#include "trace.h"
+#include "tty.h"
 
 #include "queue.h"
+#include "syscall_common.h"
+
+// Virtual runtime accrued by a nice 0 process in one tick
+#define SCHEDULER_VRUNTIME_TICK     1024
+
+// Most virtual runtime a process can be credited for sleeping
+#define SCHEDULER_SLEEPER_CREDIT    (SCHEDULER_LATENCY * SCHEDULER_VRUNTIME_TICK / 2)
+
+// Virtual runtime a woken process must be behind to preempt the running one
+#define SCHEDULER_WAKEUP_GRAN       (SCHEDULER_MIN_GRANULARITY * SCHEDULER_VRUNTIME_TICK)
 
 // Process Queues
-queue_t run_queue;      // Run queue -> processes that will be scheduled to run
+// Run queues -> processes that will be scheduled to run (one per CPU, see cpu_t)
 queue_t sleep_queue; // Sleep queue -> processes that are sleeping
 
+// Load average sampling
+// Averages are fixed point with SCHEDULER_LOAD_SHIFT fractional bits and
+// decay by ONE * e^(-interval / window) every SCHEDULER_LOAD_SAMPLE_MS
+#define SCHEDULER_LOAD_SAMPLE_MS    100
+#define SCHEDULER_LOAD_SHIFT        11
+#define SCHEDULER_LOAD_ONE          (1 << SCHEDULER_LOAD_SHIFT)
+#define SCHEDULER_LOAD_EXP_1        1853    // 1 second window
+#define SCHEDULER_LOAD_EXP_5        2007    // 5 second window
+#define SCHEDULER_LOAD_EXP_15       2034    // 15 second window
+
+// Runnable processes averaged over 1, 5 and 15 seconds
+unsigned int scheduler_loadavg[3];
+
+// Fraction of idle CPUs averaged over 1 second
+unsigned int scheduler_idleavg;
+
+// Most processes waiting to run at once
+int scheduler_run_queue_max;
+
+// Enqueue counter, orders MLFQ processes within a level (first in, first out)
+unsigned int scheduler_mlfq_seq;
+
+static void scheduler_edf_tick(cpu_t *cpu);
+
+// Scheduling weight for each nice value (-20 to 19); each step is ~1.25x
+const unsigned int scheduler_nice_weight[SCHEDULER_NICE_MAX - SCHEDULER_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15
+};
+
+/**
+ * Wakes up every process in the sleep queue whose sleep time has passed
+ * scheduler_add preempts the running process where the woken one should
+ * run first (any real-time job, or a fair process far enough behind)
+ */
+static void scheduler_wake_sleepers(void) {
+    int current_time = timer_get_ticks();
+    int count = sleep_queue.size;
+
+    // Loop through the sleep queue to wake up processes if necessary
+    for (int i = 0; i < count; i++) {
+        int sleep_pid;
+        if (queue_out(&sleep_queue, &sleep_pid) != 0) {
+            kernel_panic("Unable to dequeue process from sleep queue");
+        }
+        proc_t *sleep_proc = pid_to_proc(sleep_pid);
+        if (!sleep_proc) {
+            kernel_panic("Invalid process in sleep queue");
+            return;
+        }
+        // Check if the process should wake up
+        if (current_time >= sleep_proc->sleep_time) {
+            // Add the process back to the scheduler
+            scheduler_add(sleep_proc);
+            kernel_log_trace("Process pid=%d woke up from sleep", sleep_proc->pid);
+        } else {
+            // Process should remain asleep, add it back to the sleep queue
+            queue_in(&sleep_queue, sleep_proc->pid);
+        }
+    }
+}
+
 /**
  * Scheduler timer callback
+ * Charges the tick to the running process and enforces real-time budgets
+ * The bootstrap CPU (which drives the system tick) also wakes up the
+ * sleepers that are due, so they do not wait for the running process'
+ * time slice to end
  */
 void scheduler_timer(void) {
+    cpu_t *cpu = smp_cpu();
+    proc_t *proc = cpu->current;
+
     // Update the active process' run time and CPU time
-    if (active_proc) {
-        active_proc->run_time++;
-        active_proc->cpu_time++;
+    if (proc) {
+        proc->run_time++;
+        proc->cpu_time++;
+
+        // Heavier (lower nice) processes accrue virtual runtime more slowly
+        if (proc->sched_class == SCHED_CLASS_FAIR && proc->weight) {
+            proc->vruntime += (SCHEDULER_VRUNTIME_TICK * 1024) / proc->weight;
+        }
+    }
+
+    scheduler_edf_tick(cpu);
+
+    if (cpu->id == 0) {
+        scheduler_wake_sleepers();
+    }
+
+    // Update the load statistics of this CPU
+    if (!cpu->current || cpu->current == cpu->idle) {
+        cpu->idle_ticks++;
+    } else {
+        cpu->busy_ticks++;
+    }
+}
+
+/**
+ * Applies one sample to an exponentially decayed average
+ * @param avg - current average (fixed point)
+ * @param exp - decay factor (fixed point)
+ * @param sample - new sample (fixed point)
+ * @return updated average
+ */
+static unsigned int scheduler_load_decay(unsigned int avg, unsigned int exp, unsigned int sample) {
+    return (avg * exp + sample * (SCHEDULER_LOAD_ONE - exp) + SCHEDULER_LOAD_ONE / 2) >> SCHEDULER_LOAD_SHIFT;
+}
+
+/**
+ * Load average timer callback
+ * Samples the number of runnable processes and idle CPUs
+ */
+void scheduler_load_sample(void) {
+    int runnable = 0;
+    int queued = 0;
+    int idle = 0;
+    int cpus = 0;
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+
+        if (!cpu->started) {
+            continue;
+        }
+
+        cpus++;
+        queued += cpu->run_count;
+
+        if (cpu->current && cpu->current != cpu->idle) {
+            runnable++;
+        } else {
+            idle++;
+        }
+    }
+
+    runnable += queued;
+
+    if (queued > scheduler_run_queue_max) {
+        scheduler_run_queue_max = queued;
+    }
+
+    scheduler_loadavg[0] = scheduler_load_decay(scheduler_loadavg[0], SCHEDULER_LOAD_EXP_1,
+                                                runnable << SCHEDULER_LOAD_SHIFT);
+    scheduler_loadavg[1] = scheduler_load_decay(scheduler_loadavg[1], SCHEDULER_LOAD_EXP_5,
+                                                runnable << SCHEDULER_LOAD_SHIFT);
+    scheduler_loadavg[2] = scheduler_load_decay(scheduler_loadavg[2], SCHEDULER_LOAD_EXP_15,
+                                                runnable << SCHEDULER_LOAD_SHIFT);
+
+    if (cpus) {
+        scheduler_idleavg = scheduler_load_decay(scheduler_idleavg, SCHEDULER_LOAD_EXP_1,
+                                                 (idle << SCHEDULER_LOAD_SHIFT) / cpus);
+    }
+}
+
+/**
+ * Gets the system load summary
+ * @param load - pointer to the summary to fill in
+ * @return 0 on success, -1 on error
+ */
+int scheduler_load_get(sys_load_t *load) {
+    if (!load) {
+        return -1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        load->load[i] = (scheduler_loadavg[i] * 100 + SCHEDULER_LOAD_ONE / 2) >> SCHEDULER_LOAD_SHIFT;
+    }
+
+    load->idle_pct = (scheduler_idleavg * 100 + SCHEDULER_LOAD_ONE / 2) >> SCHEDULER_LOAD_SHIFT;
+    load->run_queue = 0;
+    load->run_queue_max = scheduler_run_queue_max;
+    load->cpus = 0;
+    load->procs = 0;
+    load->procs_max = PROC_MAX;
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+
+        if (cpu->started) {
+            load->cpus++;
+            load->run_queue += cpu->run_count;
+        }
+    }
+
+    for (int i = 0; i < PROC_MAX; i++) {
+        if (entry_to_proc(i)->state != NONE) {
+            load->procs++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the number of ticks until the next sleeping process wakes up
+ * @return ticks until the next wakeup, -1 if no process is sleeping
+ */
+int scheduler_next_wakeup(void) {
+    int now = timer_get_ticks();
+    int next = -1;
+
+    for (int i = 0; i < sleep_queue.size; i++) {
+        proc_t *proc = pid_to_proc(sleep_queue.items[(sleep_queue.head + i) % QUEUE_SIZE]);
+
+        if (proc) {
+            int ticks = proc->sleep_time - now;
+
+            if (ticks < 0) {
+                ticks = 0;
+            }
+
+            if (next < 0 || ticks < next) {
+                next = ticks;
+            }
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Indicates if the process is the idle process of any CPU
+ * @param proc - pointer to the process entry
+ * @return 1 if it is an idle process, 0 otherwise
+ */
+int scheduler_is_idle(proc_t *proc) {
+    for (int i = 0; i < CPU_MAX; i++) {
+        if (proc && smp_get_cpu(i)->idle == proc) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the number of runnable processes assigned to a CPU
+ * @param cpu - pointer to the CPU entry
+ * @return number of queued and running (non-idle) processes
+ */
+int scheduler_cpu_load(cpu_t *cpu) {
+    int load = cpu->run_count;
+
+    if (cpu->current && cpu->current != cpu->idle) {
+        load++;
+    }
+
+    return load;
+}
+
+/**
+ * Compares the order in which two processes of the same class should run
+ * Real-time processes are ordered by deadline, fair processes by virtual
+ * runtime (or by MLFQ level, then arrival). Wraparound safe as long as the
+ * values are within 2^31 of each other
+ * @return 1 if `a` should run before `b`, 0 otherwise
+ */
+static int scheduler_before(proc_t *a, proc_t *b) {
+    if (a->sched_class == SCHED_CLASS_EDF) {
+        return a->rt_deadline - b->rt_deadline < 0;
+    }
+
+    if (SCHEDULER_MLFQ) {
+        if (a->mlfq_level != b->mlfq_level) {
+            return a->mlfq_level < b->mlfq_level;
+        }
+
+        return (int)(a->mlfq_seq - b->mlfq_seq) < 0;
+    }
+
+    return (int)(a->vruntime - b->vruntime) < 0;
+}
+
+/**
+ * Returns the run queue of a CPU that holds processes of the given class
+ */
+static run_heap_t *scheduler_heap(cpu_t *cpu, proc_t *proc) {
+    return (proc->sched_class == SCHED_CLASS_EDF) ? &cpu->edf : &cpu->fair;
+}
+
+/**
+ * Swaps two entries of a run queue heap
+ */
+static void scheduler_heap_swap(run_heap_t *heap, int i, int j) {
+    proc_t *tmp = heap->procs[i];
+
+    heap->procs[i] = heap->procs[j];
+    heap->procs[j] = tmp;
+    heap->procs[i]->run_index = i;
+    heap->procs[j]->run_index = j;
+}
+
+/**
+ * Restores the order of a run queue heap around the given entry
+ */
+static void scheduler_heap_fix(run_heap_t *heap, int i) {
+    // Move up while the entry runs before its parent
+    while (i > 0 && scheduler_before(heap->procs[i], heap->procs[(i - 1) / 2])) {
+        scheduler_heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    // Move down while a child runs before the entry
+    while (1) {
+        int min = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+
+        if (left < heap->count && scheduler_before(heap->procs[left], heap->procs[min])) {
+            min = left;
+        }
+
+        if (right < heap->count && scheduler_before(heap->procs[right], heap->procs[min])) {
+            min = right;
+        }
+
+        if (min == i) {
+            break;
+        }
+
+        scheduler_heap_swap(heap, i, min);
+        i = min;
+    }
+}
+
+/**
+ * Removes a process from the run queue it is in
+ * @param proc - pointer to the process entry
+ */
+static void scheduler_dequeue(proc_t *proc) {
+    cpu_t *cpu = proc->run_cpu;
+    run_heap_t *heap;
+    int i = proc->run_index;
+
+    if (!cpu) {
+        return;
+    }
+
+    heap = scheduler_heap(cpu, proc);
+    heap->count--;
+    cpu->run_count--;
+
+    if (proc->sched_class == SCHED_CLASS_FAIR) {
+        cpu->run_weight -= proc->weight;
+        cpu->mlfq_depth[proc->mlfq_level]--;
+    }
+
+    if (i != heap->count) {
+        heap->procs[i] = heap->procs[heap->count];
+        heap->procs[i]->run_index = i;
+        scheduler_heap_fix(heap, i);
+    }
+
+    proc->run_cpu = NULL;
+}
+
+/**
+ * Takes the first process from a run queue
+ * @param heap - pointer to the run queue
+ * @return pointer to the process entry, NULL if the run queue is empty
+ */
+static proc_t *scheduler_pick(run_heap_t *heap) {
+    proc_t *proc;
+
+    if (heap->count == 0) {
+        return NULL;
+    }
+
+    proc = heap->procs[0];
+    scheduler_dequeue(proc);
+    return proc;
+}
+
+/**
+ * Takes the process that a time slice was donated to, if it is still
+ * waiting to run on this CPU
+ * @param cpu - pointer to the CPU entry
+ * @return pointer to the process entry, NULL if there is none
+ */
+static proc_t *scheduler_pick_donee(cpu_t *cpu) {
+    proc_t *proc = cpu->yield_to;
+
+    if (!proc || proc->run_cpu != cpu || proc->sched_class != SCHED_CLASS_FAIR) {
+        return NULL;
+    }
+
+    scheduler_dequeue(proc);
+    return proc;
+}
+
+/**
+ * Adds a process to the run queue of the given CPU
+ * @param cpu - pointer to the CPU entry
+ * @param proc - pointer to the process entry
+ */
+void scheduler_enqueue(cpu_t *cpu, proc_t *proc) {
+    run_heap_t *heap = scheduler_heap(cpu, proc);
+
+    if (proc->run_cpu || heap->count >= PROC_MAX) {
+        kernel_panic("Unable to add the process to the scheduler");
+    }
+
+    proc->state = IDLE;
+    proc->cpu_time = 0;
+
+    proc->run_cpu = cpu;
+    proc->run_index = heap->count;
+    proc->mlfq_seq = scheduler_mlfq_seq++;
+    heap->procs[heap->count++] = proc;
+    cpu->run_count++;
+
+    if (proc->sched_class == SCHED_CLASS_FAIR) {
+        int level = proc->mlfq_level;
+
+        cpu->run_weight += proc->weight;
+
+        if (++cpu->mlfq_depth[level] > cpu->mlfq_depth_max[level]) {
+            cpu->mlfq_depth_max[level] = cpu->mlfq_depth[level];
+        }
+    }
+
+    scheduler_heap_fix(heap, proc->run_index);
+}
+
+/**
+ * Starts a new job for a real-time process
+ * Replenishes its budget and sets the deadline relative to the release
+ * @param proc - pointer to the process entry
+ * @param release - release time of the job (ticks)
+ */
+static void scheduler_edf_release(proc_t *proc, int release) {
+    proc->rt_release = release;
+    proc->rt_deadline = release + proc->rt_relative;
+    proc->rt_remaining = proc->rt_budget;
+}
+
+/**
+ * Records a missed deadline of a real-time process
+ * @param proc - pointer to the process entry
+ */
+static void scheduler_edf_miss(proc_t *proc) {
+    proc->rt_misses++;
+    smp_get_cpu(proc->rt_cpu)->edf_misses++;
+
+    kernel_log_debug("scheduler: pid=%d missed its deadline at %d", proc->pid, proc->rt_deadline);
+}
+
+/**
+ * Ends the current job of a real-time process
+ * The process sleeps until its next release, or starts the next job
+ * right away if that release has already passed
+ * @param proc - pointer to the process entry
+ */
+void scheduler_edf_complete(proc_t *proc) {
+    int now = timer_get_ticks();
+    int next = proc->rt_release + proc->rt_period;
+
+    if (next - now > 0) {
+        proc->rt_remaining = 0;
+        scheduler_sleep(proc, next - now);
+        return;
     }
+
+    // Running late: the next job is already due
+    scheduler_edf_release(proc, now);
+}
+
+/**
+ * Real-time bookkeeping for each timer tick of a CPU
+ * Enforces the budget of the running process and detects missed deadlines
+ * @param cpu - pointer to the CPU entry
+ */
+static void scheduler_edf_tick(cpu_t *cpu) {
+    int now = timer_get_ticks();
+    proc_t *proc = cpu->current;
+
+    // Budget enforcement: a process that used its budget is throttled
+    // until its next release
+    if (proc && proc->sched_class == SCHED_CLASS_EDF && proc->state == ACTIVE) {
+        if (--proc->rt_remaining <= 0) {
+            if (now - proc->rt_deadline > 0) {
+                scheduler_edf_miss(proc);
+            }
+
+            scheduler_edf_complete(proc);
+            cpu->resched = 1;
+        } else if (now - proc->rt_deadline > 0) {
+            // The job could not complete in time; move on to the next one
+            scheduler_edf_miss(proc);
+            scheduler_edf_release(proc, now);
+        }
+    }
+
+    // Queued jobs whose deadline passed before they could run
+    while (cpu->edf.count && now - cpu->edf.procs[0]->rt_deadline > 0) {
+        proc = cpu->edf.procs[0];
+
+        scheduler_edf_miss(proc);
+        scheduler_edf_release(proc, now);
+        scheduler_heap_fix(&cpu->edf, 0);
+    }
+
+    // A queued job with an earlier deadline preempts the running one
+    if (cpu->edf.count && cpu->current && cpu->current != cpu->idle &&
+        (cpu->current->sched_class != SCHED_CLASS_EDF ||
+         scheduler_before(cpu->edf.procs[0], cpu->current))) {
+        cpu->resched = 1;
+    }
+}
+
+/**
+ * Takes a runnable fair process from the CPU with the longest run queue
+ * @param cpu - pointer to the CPU entry that has nothing to run
+ * @return pointer to the stolen process entry, NULL if there was nothing to steal
+ */
+proc_t *scheduler_steal(cpu_t *cpu) {
+    cpu_t *victim = NULL;
+    proc_t *proc;
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *peer = smp_get_cpu(i);
+
+        // Real-time processes stay on the CPU they were admitted on
+        if (peer == cpu || !peer->started || peer->fair.count == 0) {
+            continue;
+        }
+
+        if (!victim || peer->fair.count > victim->fair.count) {
+            victim = peer;
+        }
+    }
+
+    if (!victim || (proc = scheduler_pick(&victim->fair)) == NULL) {
+        return NULL;
+    }
+
+    // Keep the process' position relative to the other processes
+    proc->vruntime = proc->vruntime - victim->min_vruntime + cpu->min_vruntime;
+
+    victim->stolen++;
+    cpu->steals++;
+
+    kernel_log_trace("scheduler: CPU %d stole pid=%d from CPU %d", cpu->id, proc->pid, victim->id);
+    return proc;
+}
+
+/**
+ * Wakes up an idle CPU so that it can steal work from a backlogged run queue
+ * @param cpu - pointer to the CPU entry with queued processes
+ */
+void scheduler_kick_idle(cpu_t *cpu) {
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *peer = smp_get_cpu(i);
+
+        if (peer != cpu && peer->started && peer->current == peer->idle) {
+            smp_resched(peer);
+            return;
+        }
+    }
+}
+
+/**
+ * Computes the time slice of a process that is about to run
+ * Each runnable process receives a weighted share of SCHEDULER_LATENCY
+ * (in MLFQ mode, the slice of its level)
+ * @param cpu - pointer to the CPU entry
+ * @param proc - pointer to the process entry
+ * @return time slice in ticks
+ */
+static int scheduler_slice(cpu_t *cpu, proc_t *proc) {
+    int slice = (SCHEDULER_LATENCY * proc->weight) / (cpu->run_weight + proc->weight);
+
+    // MLFQ slices depend only on the level; lower levels run longer
+    if (SCHEDULER_MLFQ) {
+        slice = SCHEDULER_MLFQ_SLICE(proc->mlfq_level);
+    }
+
+    if (slice < SCHEDULER_MIN_GRANULARITY) {
+        slice = SCHEDULER_MIN_GRANULARITY;
+    }
+
+    if (slice < 1) {
+        slice = 1;
+    }
+
+    return slice;
 }
 
 /**
@@ -37,81 +634,260 @@ void scheduler_timer(void) {
  * Should ensure that `active_proc` is set to a valid process entry
  */
 void scheduler_run(void) {
-    int pid;
+    cpu_t *cpu = smp_cpu();
+    proc_t *prev = cpu->current;
+    proc_t *next;
+
+    // A process that slept, blocked or exited was already taken off the
+    // CPU by scheduler_remove, which recorded it
+    int prev_pid = prev ? prev->pid : cpu->out_pid;
 
     // Ensure that processes not in the active state aren't still scheduled
-    if (active_proc && active_proc->state != ACTIVE) {
-        active_proc = NULL;
+    if (cpu->current && cpu->current->state != ACTIVE) {
+        cpu->current = NULL;
     }
 
     // Check if we have an active process
-    if (active_proc) {
+    if (cpu->current) {
+        proc_t *proc = cpu->current;
+
         // Check if the current process has exceeded its time slice
-        if (active_proc->cpu_time >= SCHEDULER_TIMESLICE) {
+        // or a process with less virtual runtime has woken up
+        // The idle process is always re-evaluated so that woken or new
+        // processes do not wait for its time slice to expire
+        if (proc->cpu_time >= proc->slice || cpu->resched || proc == cpu->idle) {
+            // MLFQ: a process that used its whole slice is CPU bound and
+            // drops a level
+            if (SCHEDULER_MLFQ && proc->sched_class == SCHED_CLASS_FAIR &&
+                proc->cpu_time >= proc->slice && proc->mlfq_level < SCHEDULER_MLFQ_LEVELS - 1) {
+                proc->mlfq_level++;
+            }
+
             // Reset the active time
-            active_proc->cpu_time = 0;
+            proc->cpu_time = 0;
 
             // If the process is not the idle task, add it back to the scheduler
             // Otherwise, simply set the state to IDLE
-            
-            if (active_proc->pid != 0) {
+            // Processes stay on the same CPU while they remain runnable
+            if (proc != cpu->idle) {
                 // Add the process to the scheduler
-                scheduler_add(active_proc);
+                if (proc->sched_class == SCHED_CLASS_EDF) {
+                    scheduler_enqueue(smp_get_cpu(proc->rt_cpu), proc);
+                } else {
+                    scheduler_enqueue(cpu, proc);
+                }
             } else {
-                active_proc->state = IDLE;
+                proc->state = IDLE;
             }
 
             // Unschedule the current process
-            kernel_log_trace("Unscheduling process pid=%d, name=%s", active_proc->pid, active_proc->name);
-            active_proc = NULL;
+            kernel_log_trace("Unscheduling process pid=%d, name=%s", proc->pid, proc->name);
+            cpu->current = NULL;
         }
     }
 
     // Check if we have a process scheduled or not
-    if (!active_proc) {
+    if (!cpu->current) {
         // Check if there are any processes in the sleep queue that need to wake up
-        if (!queue_is_empty(&sleep_queue)) {
-            int current_time = timer_get_ticks();
-
-            // Loop through the sleep queue to wake up processes if necessary
-            for (int i = 0; i < sleep_queue.size; i++) {
-                int sleep_pid;
-                if (queue_out(&sleep_queue, &sleep_pid) != 0) {
-                    kernel_panic("Unable to dequeue process from sleep queue");
-                }
-                proc_t *sleep_proc = pid_to_proc(sleep_pid);
-                if (!sleep_proc) {
-                    kernel_panic("Invalid process in sleep queue");
-                }
-                // Check if the process should wake up
-                if (current_time >= sleep_proc->sleep_time) {
-                    // Add the process back to the scheduler
-                    scheduler_add(sleep_proc);
-                    kernel_log_trace("Process pid=%d woke up from sleep", sleep_proc->pid);
-                } else {
-                    // Process should remain asleep, add it back to the sleep queue
-                    queue_in(&sleep_queue, sleep_proc->pid);
-                }
+        scheduler_wake_sleepers();
+
+        // Run the real-time process with the earliest deadline, otherwise
+        // the process a time slice was donated to, otherwise the fair
+        // process with the lowest virtual runtime
+        // If there is nothing to run, try to steal from a busier CPU
+        if ((next = scheduler_pick(&cpu->edf)) == NULL &&
+            (next = scheduler_pick_donee(cpu)) == NULL &&
+            (next = scheduler_pick(&cpu->fair)) == NULL &&
+            (next = scheduler_steal(cpu)) == NULL) {
+            // default to the idle task of this CPU
+            next = cpu->idle;
+        }
+
+        // Make sure we have a valid process at this point
+        if (!next) {
+            kernel_panic("Unable to schedule a process!");
+            return;
+        }
+
+        if (next->sched_class == SCHED_CLASS_EDF) {
+            // Runs until its budget is used up or a job with an earlier deadline arrives
+            next->slice = next->rt_remaining;
+        } else if (next == cpu->yield_to) {
+            // Runs for what is left of the donor's time slice
+            next->slice = cpu->yield_slice;
+        } else if (next != cpu->idle) {
+            // Track the smallest virtual runtime so that woken and new
+            // processes are placed relative to the running ones
+            if ((int)(next->vruntime - cpu->min_vruntime) > 0) {
+                cpu->min_vruntime = next->vruntime;
             }
+
+            next->slice = scheduler_slice(cpu, next);
+            cpu->mlfq_runs[next->mlfq_level]++;
         }
 
-        // Get the process id from the run queue
-        if (queue_out(&run_queue, &pid) != 0) {
-            // default to process id 0 (idle task)
-            pid = 0;
+        cpu->current = next;
+        cpu->switches++;
+        cpu->yield_to = NULL;
+
+        if (prev != next) {
+            if (prev) {
+                trace_event(TRACE_SWITCH_OUT, prev->pid, prev->state);
+            } else if (prev_pid >= 0) {
+                trace_event(TRACE_SWITCH_OUT, prev_pid, cpu->out_state);
+            }
+
+            trace_event(TRACE_SWITCH_IN, next->pid, prev_pid);
         }
 
-        active_proc = pid_to_proc(pid);
-        kernel_log_trace("Scheduling process pid=%d, name=%s", active_proc->pid, active_proc->name);
-    }
+        cpu->out_pid = -1;
+
+        // A process that is still runnable (queued) was preempted unless it
+        // yielded; one that gave up the CPU was counted by scheduler_remove
+        if (prev && prev != next && prev != cpu->idle && prev->state != NONE) {
+            if (prev->run_cpu && !cpu->yielded) {
+                prev->switches_involuntary++;
+            } else {
+                prev->switches_voluntary++;
+            }
+        }
+
+        // Let an idle CPU pick up the processes still waiting here
+        if (cpu->fair.count) {
+            scheduler_kick_idle(cpu);
+        }
 
-    // Make sure we have a valid process at this point
-    if (!active_proc) {
-        kernel_panic("Unable to schedule a process!");
+        kernel_log_trace("Scheduling process pid=%d, name=%s", cpu->current->pid, cpu->current->name);
     }
 
+    cpu->resched = 0;
+    cpu->yielded = 0;
+
     // Ensure that the process state is correct
-    active_proc->state = ACTIVE;
+    cpu->current->state = ACTIVE;
+
+    // Only the idle process is runnable; stop the tick until there is work
+    // (queued log messages wake the kernel log process and queued output
+    // is drawn at the next ticks)
+    if (cpu->current == cpu->idle && cpu->run_count == 0 && !kernel_log_pending() && !tty_pending()) {
+        timer_tickless_enter(scheduler_next_wakeup());
+    }
+}
+
+/**
+ * Adds a real-time process to the run queue of the CPU it was admitted on
+ * A process that wakes after its period has passed starts a new job
+ * (sporadic release); one that already used its budget waits for the
+ * next release
+ * @param proc - pointer to the process entry
+ */
+static void scheduler_edf_add(proc_t *proc) {
+    cpu_t *target = smp_get_cpu(proc->rt_cpu);
+    int now = timer_get_ticks();
+    int next = proc->rt_release + proc->rt_period;
+
+    if (now - next >= 0) {
+        scheduler_edf_release(proc, now);
+    } else if (proc->rt_remaining <= 0) {
+        scheduler_sleep(proc, next - now);
+        return;
+    }
+
+    scheduler_enqueue(target, proc);
+
+    // Preempt fair processes and real-time processes with a later deadline
+    if (target->current == target->idle || !target->current ||
+        target->current->sched_class != SCHED_CLASS_EDF ||
+        scheduler_before(proc, target->current)) {
+        target->resched = 1;
+        smp_resched(target);
+    }
+}
+
+/**
+ * Gives up the rest of the time slice of the running process
+ * The process goes back to its run queue behind the processes that are
+ * waiting. If a fair process is given and it is waiting to run, it runs
+ * next for what is left of the time slice (directed yield)
+ * @param proc - pointer to the yielding (active) process entry
+ * @param target - pointer to the process to donate to, NULL for none
+ */
+void scheduler_yield(proc_t *proc, proc_t *target) {
+    cpu_t *cpu = smp_cpu();
+    int remaining = proc->slice - proc->cpu_time;
+
+    if (remaining < 0) {
+        remaining = 0;
+    }
+
+    // Charge the forfeited time so the process is queued behind its peers
+    // (in MLFQ mode, re-queueing places it at the back of its level)
+    if (proc->sched_class == SCHED_CLASS_FAIR && proc != cpu->idle) {
+        proc->vruntime += remaining * ((SCHEDULER_VRUNTIME_TICK * 1024) / proc->weight);
+    }
+
+    // Real-time budgets belong to the donor's reservation; only fair
+    // processes donate. The target is pulled to this CPU if it is
+    // waiting elsewhere
+    if (target && target != proc && remaining > 0 &&
+        proc->sched_class == SCHED_CLASS_FAIR && target->sched_class == SCHED_CLASS_FAIR &&
+        target->run_cpu) {
+        cpu_t *from = target->run_cpu;
+
+        if (from != cpu) {
+            scheduler_dequeue(target);
+            target->vruntime = target->vruntime - from->min_vruntime + cpu->min_vruntime;
+            scheduler_enqueue(cpu, target);
+        }
+
+        cpu->yield_to = target;
+        cpu->yield_slice = remaining;
+
+        kernel_log_trace("scheduler: pid=%d donated %d ticks to pid=%d", proc->pid, remaining, target->pid);
+    }
+
+    cpu->resched = 1;
+    cpu->yielded = 1;
+}
+
+/**
+ * Indicates if a woken fair process should preempt the running one
+ * @param proc - pointer to the woken process entry
+ * @param current - pointer to the running process entry
+ * @return 1 if the running process should be preempted, 0 otherwise
+ */
+static int scheduler_fair_preempts(proc_t *proc, proc_t *current) {
+    if (SCHEDULER_MLFQ) {
+        return proc->mlfq_level < current->mlfq_level;
+    }
+
+    // Only if sufficiently behind in virtual runtime
+    return (int)(proc->vruntime + SCHEDULER_WAKEUP_GRAN - current->vruntime) < 0;
+}
+
+/**
+ * MLFQ priority boost
+ * Periodically returns every process to the top level so CPU bound
+ * processes are not starved by a stream of interactive ones
+ */
+void scheduler_mlfq_boost(void) {
+    for (int i = 0; i < PROC_MAX; i++) {
+        entry_to_proc(i)->mlfq_level = 0;
+    }
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+
+        for (int level = 1; level < SCHEDULER_MLFQ_LEVELS; level++) {
+            cpu->mlfq_depth[level] = 0;
+        }
+        cpu->mlfq_depth[0] = cpu->fair.count;
+
+        // Order is now by arrival only; rebuild the heap
+        for (int j = cpu->fair.count / 2 - 1; j >= 0; j--) {
+            scheduler_heap_fix(&cpu->fair, j);
+        }
+    }
 }
 
 /**
@@ -119,16 +895,59 @@ void scheduler_run(void) {
  * @param proc - pointer to the process entry
  */
 void scheduler_add(proc_t *proc) {
+    cpu_t *target = smp_cpu();
+    unsigned int floor;
+
     if (!proc) {
         kernel_panic("Invalid process!");
+        return;
     }
 
-    proc->scheduler_queue = &run_queue;
-    proc->state = IDLE;
-    proc->cpu_time = 0;
+    if (proc->state == SLEEPING || proc->state == BLOCKED) {
+        trace_event(TRACE_WAKEUP, proc->pid, proc->state);
+        proc->wakeups++;
+    }
 
-    if (queue_in(proc->scheduler_queue, proc->pid) != 0) {
-        kernel_panic("Unable to add the process to the scheduler");
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        scheduler_edf_add(proc);
+        return;
+    }
+
+    // Place the process on the least loaded CPU
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+
+        if (cpu->started && scheduler_cpu_load(cpu) < scheduler_cpu_load(target)) {
+            target = cpu;
+        }
+    }
+
+    // New processes start level with the others. Processes that slept are
+    // credited up to half a latency period so they run ahead of CPU hogs,
+    // but cannot bank the time they spent asleep
+    floor = target->min_vruntime - SCHEDULER_SLEEPER_CREDIT;
+
+    if (proc->run_time == 0 || (int)(proc->vruntime - target->min_vruntime) > 0) {
+        proc->vruntime = target->min_vruntime;
+    } else if ((int)(proc->vruntime - floor) < 0) {
+        proc->vruntime = floor;
+    }
+
+    // MLFQ: processes that slept or blocked are interactive and gain a level
+    if (proc->run_time != 0 && proc->mlfq_level > 0) {
+        proc->mlfq_level--;
+    }
+
+    scheduler_enqueue(target, proc);
+
+    // Wake the CPU up if it is only running its idle process, or preempt
+    // a fair process that the new one should run ahead of
+    if (target->current == target->idle) {
+        smp_resched(target);
+    } else if (target->current && target->current->sched_class == SCHED_CLASS_FAIR &&
+               scheduler_fair_preempts(proc, target->current)) {
+        target->resched = 1;
+        smp_resched(target);
     }
 }
 
@@ -137,40 +956,59 @@ void scheduler_add(proc_t *proc) {
  * @param proc - pointer to the process entry
  */
 void scheduler_remove(proc_t *proc) {
-    int pid;
-
     if (!proc) {
         kernel_panic("Invalid process!");
         exit(1);
     }
 
-    if (proc->scheduler_queue) {
-        for (int i = 0; i < proc->scheduler_queue->size; i++) {
-            if (queue_out(proc->scheduler_queue, &pid) != 0) {
-                kernel_panic("Unable to queue out the process entry");
-            }
+    // Remove the process from the run queue it is waiting in
+    scheduler_dequeue(proc);
 
-            if (proc->pid == pid) {
-                // Found the process
-                // continue iterating so the run queue order is maintained
-                continue;
-            }
+    // If the process is running on any CPU, ensure that the CPU's
+    // process is reset so a new process will be scheduled
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
 
-            // Add the item back to the run queue
-            if (queue_in(proc->scheduler_queue, pid) != 0) {
-                kernel_panic("Unable to queue process back to the run queue");
-            }
+        if (proc == cpu->current) {
+            // The process gave up the CPU (sleep, block, exit). Its entry
+            // may be destroyed before the next scheduler run on that CPU,
+            // so the switch is counted and recorded here
+            proc->switches_voluntary++;
+            cpu->out_pid = proc->pid;
+            cpu->out_state = proc->state;
+            cpu->current = NULL;
+            smp_resched(cpu);
         }
+    }
+}
+
+/**
+ * Sets the nice value (and scheduling weight) of a process
+ * @param proc - pointer to the process entry
+ * @param nice - nice value (SCHEDULER_NICE_MIN to SCHEDULER_NICE_MAX)
+ * @return 0 on success, -1 on error
+ */
+int scheduler_set_nice(proc_t *proc, int nice) {
+    cpu_t *cpu;
 
-        // Set the queue to NULL since it does not exist in a queue any longer
-        proc->scheduler_queue = NULL;
+    if (!proc || nice < SCHEDULER_NICE_MIN || nice > SCHEDULER_NICE_MAX) {
+        return -1;
     }
 
-    // If the process is the current process, ensure that the current
-    // process is reset so a new process will be scheduled
-    if (proc == active_proc) {
-        active_proc = NULL;
+    // Keep the run queue weight consistent if the process is queued
+    cpu = proc->run_cpu;
+    if (cpu) {
+        cpu->run_weight -= proc->weight;
     }
+
+    proc->nice = nice;
+    proc->weight = scheduler_nice_weight[nice - SCHEDULER_NICE_MIN];
+
+    if (cpu) {
+        cpu->run_weight += proc->weight;
+    }
+
+    return 0;
 }
 
 /**
@@ -179,6 +1017,8 @@ void scheduler_remove(proc_t *proc) {
  * @param time - number of ticks to sleep
  */
 void scheduler_sleep(proc_t *proc, int time) {
+    trace_event(TRACE_SLEEP, proc->pid, time);
+
      // Set the sleep time
     proc->sleep_time = timer_get_ticks() + time;
     // Set the process state to SLEEPING
@@ -195,13 +1035,157 @@ void scheduler_sleep(proc_t *proc, int time) {
 void scheduler_init(void) {
     kernel_log_info("Initializing scheduler");
 
-    /* Initialize the run queue */
-    queue_init(&run_queue);
-
     /* Initialize the sleep queue */
     queue_init(&sleep_queue);
 
+    /* No process has run yet */
+    for (int i = 0; i < CPU_MAX; i++) {
+        smp_get_cpu(i)->out_pid = -1;
+    }
+
     /* Register the timer callback */
-    timer_callback_register(&scheduler_timer, 1, -1);
+    /* Sleepers bound the tickless idle (scheduler_next_wakeup); the rest is
+       accounting that can wait for the skipped ticks to be replayed */
+    timer_callback_defer(timer_callback_register(&scheduler_timer, 1, -1));
+
+    /* Register the load average sampling */
+    timer_callback_defer(timer_callback_register(&scheduler_load_sample, TIMER_MS_TO_TICKS(SCHEDULER_LOAD_SAMPLE_MS), -1));
+
+    /* Register the MLFQ priority boost */
+    if (SCHEDULER_MLFQ) {
+        timer_callback_defer(timer_callback_register(&scheduler_mlfq_boost, TIMER_MS_TO_TICKS(SCHEDULER_MLFQ_BOOST_MS), -1));
+    }
 }
 
+/**
+ * Places a process in the real-time (EDF) class, or returns it to the
+ * fair class when period is 0
+ * The process is admitted on the CPU with the least real-time utilization
+ * as long as that CPU stays within SCHEDULER_EDF_UTIL_MAX
+ * @param proc - pointer to the process entry
+ * @param period - period (ticks)
+ * @param budget - execution budget per period (ticks)
+ * @param deadline - relative deadline (ticks), 0 to use the period
+ * @return 0 on success, -1 if the parameters are invalid or admission fails
+ */
+int scheduler_set_edf(proc_t *proc, int period, int budget, int deadline) {
+    unsigned int util = 0;
+    unsigned int old = 0;
+    cpu_t *target = NULL;
+    cpu_t *prev = NULL;
+    int queued;
+
+    if (!proc || scheduler_is_idle(proc)) {
+        return -1;
+    }
+
+    if (deadline == 0) {
+        deadline = period;
+    }
+
+    if (period != 0) {
+        if (period < 0 || budget <= 0 || budget > deadline || deadline > period) {
+            return -1;
+        }
+
+        util = (budget * 1000 + period - 1) / period;
+    }
+
+    // The current reservation is given up if the process is re-admitted
+    if (proc->sched_class == SCHED_CLASS_EDF) {
+        prev = smp_get_cpu(proc->rt_cpu);
+        old = (proc->rt_budget * 1000 + proc->rt_period - 1) / proc->rt_period;
+    }
+
+    if (period != 0) {
+        for (int i = 0; i < CPU_MAX; i++) {
+            cpu_t *cpu = smp_get_cpu(i);
+            unsigned int used;
+
+            if (!cpu->started) {
+                continue;
+            }
+
+            used = cpu->edf_util - ((cpu == prev) ? old : 0);
+
+            if (used + util <= SCHEDULER_EDF_UTIL_MAX &&
+                (!target || used < target->edf_util - ((target == prev) ? old : 0))) {
+                target = cpu;
+            }
+        }
+
+        if (!target) {
+            kernel_log_warn("scheduler: pid=%d not admitted (%u permille)", proc->pid, util);
+            return -1;
+        }
+    }
+
+    // Processes move between run queues when they change class
+    queued = (proc->run_cpu != NULL);
+    if (queued) {
+        scheduler_dequeue(proc);
+    }
+
+    if (prev) {
+        prev->edf_util -= old;
+    }
+
+    if (period != 0) {
+        target->edf_util += util;
+
+        proc->sched_class = SCHED_CLASS_EDF;
+        proc->rt_cpu = target->id;
+        proc->rt_period = period;
+        proc->rt_budget = budget;
+        proc->rt_relative = deadline;
+        scheduler_edf_release(proc, timer_get_ticks());
+
+        kernel_log_info("scheduler: pid=%d admitted on CPU %d (%u permille)", proc->pid, target->id, util);
+    } else {
+        proc->sched_class = SCHED_CLASS_FAIR;
+        proc->rt_period = 0;
+    }
+
+    if (queued) {
+        scheduler_add(proc);
+    }
+
+    // A running process is requeued according to its new class
+    for (int i = 0; i < CPU_MAX; i++) {
+        if (smp_get_cpu(i)->current == proc) {
+            smp_get_cpu(i)->resched = 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Prints the load statistics of every CPU to the kernel log
+ */
+void scheduler_cpu_dump(void) {
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+        unsigned int total = cpu->busy_ticks + cpu->idle_ticks;
+
+        if (!cpu->started) {
+            continue;
+        }
+
+        kernel_log_info("scheduler: CPU %d busy=%u%% queue=%d switches=%u steals=%u stolen=%u",
+                        cpu->id, total ? (cpu->busy_ticks * 100) / total : 0,
+                        cpu->fair.count, cpu->switches, cpu->steals, cpu->stolen);
+        kernel_log_info("scheduler: CPU %d kernel exits fast=%u full=%u",
+                        cpu->id, cpu->exit_fast, cpu->exit_full);
+        kernel_log_info("scheduler: CPU %d real-time utilization=%u permille queue=%d misses=%u",
+                        cpu->id, cpu->edf_util, cpu->edf.count, cpu->edf_misses);
+
+        if (SCHEDULER_MLFQ) {
+            for (int level = 0; level < SCHEDULER_MLFQ_LEVELS; level++) {
+                kernel_log_info("scheduler: CPU %d MLFQ level %d depth=%d max=%d runs=%u",
+                                cpu->id, level, cpu->mlfq_depth[level],
+                                cpu->mlfq_depth_max[level], cpu->mlfq_runs[level]);
+            }
+        }
+    }
+}
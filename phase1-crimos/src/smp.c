@@ -0,0 +1,486 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Symmetric Multiprocessing
+ */
+#include <spede/string.h>
+
+#include "apic.h"
+#include "fpu.h"
+#include "interrupts.h"
+#include "kernel.h"
+#include "kproc.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "timer.h"
+#include "tsc.h"
+
+// Time to wait for an application processor to report in (ms)
+#define SMP_START_TIMEOUT_MS    100
+
+// Intel MultiProcessor Specification tables
+#define MP_FLOAT_SIG        0x5f504d5f  // "_MP_"
+#define MP_CONFIG_SIG       0x504d4350  // "PCMP"
+#define MP_ENTRY_PROC       0           // Processor entry
+#define MP_ENTRY_BUS        1           // Bus entry
+#define MP_ENTRY_IOAPIC     2           // IOAPIC entry
+#define MP_ENTRY_IOINT      3           // I/O interrupt assignment entry
+#define MP_ENTRY_SIZE       8           // Size of every entry but processor entries
+#define MP_PROC_ENABLED     0x01        // Processor is usable
+#define MP_PROC_BSP         0x02        // Processor is the bootstrap processor
+#define MP_IOAPIC_ENABLED   0x01        // IOAPIC is usable
+#define MP_INT_VECTORED     0           // I/O interrupt signalled through the IOAPIC
+#define MP_INT_ACTIVE_LOW   0x03        // Polarity field: active low
+#define MP_INT_LEVEL        0x0c        // Trigger mode field: level triggered
+
+// MP floating pointer structure
+typedef struct __attribute__((packed)) {
+    unsigned int signature;     // "_MP_"
+    unsigned int config;        // Physical address of the configuration table
+    unsigned char length;       // Structure length in 16 byte units
+    unsigned char revision;     // Specification revision
+    unsigned char checksum;     // Makes the structure sum to zero
+    unsigned char features[5];  // Default configuration (features[0] != 0) and flags
+} mp_float_t;
+
+// MP configuration table header
+typedef struct __attribute__((packed)) {
+    unsigned int signature;     // "PCMP"
+    unsigned short length;      // Base table length, including the header
+    unsigned char revision;     // Specification revision
+    unsigned char checksum;     // Makes the base table sum to zero
+    char oem[8];                // OEM id
+    char product[12];           // Product id
+    unsigned int oem_table;     // OEM table pointer
+    unsigned short oem_size;    // OEM table size
+    unsigned short count;       // Number of entries following the header
+    unsigned int lapic;         // Local APIC address
+    unsigned short ext_length;  // Extended table length
+    unsigned char ext_checksum; // Extended table checksum
+    unsigned char reserved;
+} mp_config_t;
+
+// MP configuration table processor entry
+typedef struct __attribute__((packed)) {
+    unsigned char type;         // MP_ENTRY_PROC
+    unsigned char apic_id;      // Local APIC id
+    unsigned char apic_version; // Local APIC version
+    unsigned char flags;        // MP_PROC_ENABLED, MP_PROC_BSP
+    unsigned int signature;     // CPU signature (family, model, stepping)
+    unsigned int features;      // CPUID feature flags
+    unsigned int reserved[2];
+} mp_proc_t;
+
+// MP configuration table bus entry
+typedef struct __attribute__((packed)) {
+    unsigned char type;         // MP_ENTRY_BUS
+    unsigned char bus_id;       // Bus id used by the interrupt entries
+    char name[6];               // Bus type, padded with spaces ("ISA   ")
+} mp_bus_t;
+
+// MP configuration table IOAPIC entry
+typedef struct __attribute__((packed)) {
+    unsigned char type;         // MP_ENTRY_IOAPIC
+    unsigned char apic_id;      // IOAPIC id
+    unsigned char version;      // IOAPIC version
+    unsigned char flags;        // MP_IOAPIC_ENABLED
+    unsigned int addr;          // MMIO address
+} mp_ioapic_t;
+
+// MP configuration table I/O interrupt assignment entry
+typedef struct __attribute__((packed)) {
+    unsigned char type;         // MP_ENTRY_IOINT
+    unsigned char int_type;     // MP_INT_VECTORED, NMI, SMI or ExtINT
+    unsigned short flags;       // Polarity (bits 0-1) and trigger mode (bits 2-3)
+    unsigned char src_bus;      // Source bus id
+    unsigned char src_irq;      // Source bus IRQ
+    unsigned char dst_apic;     // Destination IOAPIC id
+    unsigned char dst_pin;      // Destination IOAPIC input
+} mp_ioint_t;
+
+// Descriptor table pointer as used by sgdt/sidt/lgdt/lidt
+typedef struct __attribute__((packed)) {
+    unsigned short limit;
+    unsigned int base;
+} smp_dtr_t;
+
+// Per-CPU data table, indexed by local APIC id
+cpu_t cpu_table[CPU_MAX];
+
+// Number of CPUs that have been started
+int smp_cpu_count = 1;
+
+// IDT pointer of the bootstrap processor, shared by every CPU
+smp_dtr_t smp_idtr;
+
+// Boot kernel stacks (one per CPU), defined in context.S
+extern unsigned char kstack[];
+
+// Kernel stack used on interrupt entry, indexed by CPU (see context.S)
+unsigned char *smp_kstack_top[CPU_MAX] = { kstack + KSTACK_SIZE };
+
+// Open nestable sections (interrupts_nest_begin), indexed by CPU (see context.S)
+// Non-zero while a handler runs with interrupts enabled; interrupts
+// taken then stay on the kernel path instead of entering the kernel.
+// The nested interrupts themselves are counted in cpu_t (irq_depth)
+volatile int smp_irq_depth[CPU_MAX];
+
+/**
+ * Returns the per-CPU data of the running CPU
+ * @return pointer to the CPU entry
+ */
+cpu_t *smp_cpu(void) {
+    if (smp_cpu_count == 1 || !apic_enabled()) {
+        return &cpu_table[0];
+    }
+
+    return &cpu_table[apic_id()];
+}
+
+/**
+ * Returns the per-CPU data for the given CPU
+ * @param id - CPU index
+ * @return pointer to the CPU entry, NULL if out of range
+ */
+cpu_t *smp_get_cpu(int id) {
+    if (id >= 0 && id < CPU_MAX) {
+        return &cpu_table[id];
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the number of CPUs that have been started
+ * @return number of CPUs
+ */
+int smp_get_cpu_count(void) {
+    return smp_cpu_count;
+}
+
+/**
+ * Asks another CPU to run its scheduler
+ * @param cpu - pointer to the CPU entry
+ */
+void smp_resched(cpu_t *cpu) {
+    if (cpu && cpu->started && cpu != smp_cpu()) {
+        apic_ipi(cpu->id, APIC_IPI_FIXED | IRQ_RESCHED);
+    }
+}
+
+/**
+ * Reschedule IPI handler
+ * The scheduler runs on every kernel exit, so there is nothing else to do
+ */
+void smp_resched_handler(void) {
+}
+
+/**
+ * Busy waits for the given number of microseconds
+ * @param us - microseconds to wait
+ */
+static void smp_delay_us(unsigned int us) {
+    unsigned long long cycles = tsc_div((unsigned long long)timer_get_tsc_khz() * us, 1000);
+    unsigned long long start = tsc_read();
+
+    while (tsc_read() - start < cycles) {
+        asm volatile("pause");
+    }
+}
+
+/**
+ * Sums the bytes of a firmware table
+ * @param addr - start of the table
+ * @param len - length of the table in bytes
+ * @return sum of the bytes (0 for a valid table)
+ */
+static unsigned char smp_mp_sum(unsigned char *addr, int len) {
+    unsigned char sum = 0;
+
+    for (int i = 0; i < len; i++) {
+        sum += addr[i];
+    }
+
+    return sum;
+}
+
+/**
+ * Searches a memory range for the MP floating pointer structure
+ * @param base - physical start address (16 byte aligned)
+ * @param len - number of bytes to search
+ * @return pointer to the structure, NULL if it is not present
+ */
+static mp_float_t *smp_mp_search(unsigned int base, unsigned int len) {
+    for (unsigned int addr = base; addr + sizeof(mp_float_t) <= base + len; addr += 16) {
+        mp_float_t *mp = (mp_float_t *)addr;
+
+        if (mp->signature == MP_FLOAT_SIG && mp->length == 1
+            && smp_mp_sum((unsigned char *)mp, sizeof(mp_float_t)) == 0) {
+            return mp;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the MP configuration table provided by the firmware
+ * Searched in the first KB of the EBDA, the last KB of base memory and
+ * the BIOS ROM, as the MP specification requires
+ * @return pointer to the configuration table, NULL if there is none
+ */
+static mp_config_t *smp_mp_config(void) {
+    unsigned int ebda = *(unsigned short *)0x40e << 4;
+    unsigned int base_kb = *(unsigned short *)0x413;
+    mp_float_t *mp = NULL;
+    mp_config_t *config;
+
+    if (ebda) {
+        mp = smp_mp_search(ebda, 1024);
+    }
+
+    if (!mp) {
+        mp = smp_mp_search(base_kb * 1024 - 1024, 1024);
+    }
+
+    if (!mp) {
+        mp = smp_mp_search(0xf0000, 0x10000);
+    }
+
+    // A default configuration (no table) only describes two CPUs with
+    // fixed ids; it is not worth supporting
+    if (!mp || !mp->config || mp->features[0]) {
+        return NULL;
+    }
+
+    config = (mp_config_t *)mp->config;
+
+    if (config->signature != MP_CONFIG_SIG
+        || smp_mp_sum((unsigned char *)config, config->length) != 0) {
+        return NULL;
+    }
+
+    return config;
+}
+
+/**
+ * Returns the size of an MP configuration table entry
+ * @param entry - pointer to the entry
+ * @return entry size in bytes
+ */
+static int smp_mp_entry_size(unsigned char *entry) {
+    return (*entry == MP_ENTRY_PROC) ? sizeof(mp_proc_t) : MP_ENTRY_SIZE;
+}
+
+/**
+ * Reads the IOAPIC and the ISA interrupt routing from the MP configuration
+ * table. ISA IRQs the table does not mention keep their own pin, edge
+ * triggered and active high; overrides such as the PIT on pin 2 apply
+ * @param route - ISA IRQ routes to fill in (IOAPIC_ISA_IRQS entries), may be NULL
+ * @return MMIO address of the first usable IOAPIC, 0 if the table lists none
+ */
+unsigned int smp_mp_ioapic(ioapic_route_t *route) {
+    mp_config_t *config = smp_mp_config();
+    mp_ioapic_t *ioapic = NULL;
+    int isa_bus = -1;
+    unsigned char *entry;
+
+    if (!config) {
+        return 0;
+    }
+
+    // Find the IOAPIC and the ISA bus the interrupt entries refer to
+    entry = (unsigned char *)(config + 1);
+
+    for (int i = 0; i < config->count; entry += smp_mp_entry_size(entry), i++) {
+        if (*entry == MP_ENTRY_IOAPIC && !ioapic && (((mp_ioapic_t *)entry)->flags & MP_IOAPIC_ENABLED)) {
+            ioapic = (mp_ioapic_t *)entry;
+        } else if (*entry == MP_ENTRY_BUS && !strncmp(((mp_bus_t *)entry)->name, "ISA", 3)) {
+            isa_bus = ((mp_bus_t *)entry)->bus_id;
+        }
+    }
+
+    if (!ioapic) {
+        return 0;
+    }
+
+    if (!route) {
+        return ioapic->addr;
+    }
+
+    for (int irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+        route[irq].pin = irq;
+        route[irq].active_low = 0;
+        route[irq].level = 0;
+    }
+
+    entry = (unsigned char *)(config + 1);
+
+    for (int i = 0; i < config->count; entry += smp_mp_entry_size(entry), i++) {
+        mp_ioint_t *ioint = (mp_ioint_t *)entry;
+
+        if (*entry != MP_ENTRY_IOINT || ioint->int_type != MP_INT_VECTORED ||
+            ioint->src_bus != isa_bus || ioint->src_irq >= IOAPIC_ISA_IRQS ||
+            ioint->dst_apic != ioapic->apic_id) {
+            continue;
+        }
+
+        // Polarity and trigger mode 0 mean "as the bus defines": ISA
+        // interrupts are edge triggered, active high
+        route[ioint->src_irq].pin = ioint->dst_pin;
+        route[ioint->src_irq].active_low = ((ioint->flags & MP_INT_ACTIVE_LOW) == MP_INT_ACTIVE_LOW);
+        route[ioint->src_irq].level = ((ioint->flags & MP_INT_LEVEL) == MP_INT_LEVEL);
+    }
+
+    return ioapic->addr;
+}
+
+/**
+ * Starts a single application processor
+ * @param id - local APIC id of the processor
+ * @return 0 on success, -1 if the processor did not start
+ */
+static int smp_start_ap(int id) {
+    cpu_t *cpu = &cpu_table[id];
+    int pid;
+
+    // Each CPU needs an idle process to fall back on
+    spin_lock(&kernel_lock);
+    pid = kproc_create(kproc_idle, "idle", PROC_TYPE_KERNEL);
+    if (pid >= 0) {
+        cpu->idle = pid_to_proc(pid);
+        scheduler_remove(cpu->idle);
+    }
+    spin_unlock(&kernel_lock);
+
+    if (pid < 0) {
+        kernel_log_warn("smp: unable to create the idle process for CPU %d", id);
+        return -1;
+    }
+
+    // The processor enters the kernel on its own boot stack
+    smp_kstack_top[id] = &kstack[(id + 1) * KSTACK_SIZE];
+    *(unsigned int *)(SMP_TRAMPOLINE_ADDR + (smp_trampoline_stack - smp_trampoline_start)) =
+        (unsigned int)smp_kstack_top[id];
+
+    // INIT-SIPI-SIPI sequence
+    apic_ipi(id, APIC_IPI_INIT);
+    smp_delay_us(10000);
+    apic_ipi(id, APIC_IPI_STARTUP | (SMP_TRAMPOLINE_ADDR >> 12));
+    smp_delay_us(200);
+    apic_ipi(id, APIC_IPI_STARTUP | (SMP_TRAMPOLINE_ADDR >> 12));
+
+    for (int ms = 0; ms < SMP_START_TIMEOUT_MS && !cpu->started; ms++) {
+        smp_delay_us(1000);
+    }
+
+    if (!cpu->started) {
+        kernel_log_warn("smp: CPU %d did not start", id);
+
+        spin_lock(&kernel_lock);
+        kproc_destroy(cpu->idle);
+        cpu->idle = NULL;
+        spin_unlock(&kernel_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Application processor entry point (called from the startup trampoline)
+ */
+void smp_ap_main(void) {
+    cpu_t *cpu;
+
+    asm volatile("lidt %0" : : "m"(smp_idtr));
+
+    // Register the CPU before any per-CPU initialization: while the count
+    // is 1, smp_cpu() returns the bootstrap CPU's entry
+    spin_lock(&kernel_lock);
+    smp_cpu_count++;
+    spin_unlock(&kernel_lock);
+
+    cpu = smp_cpu();
+
+    apic_ap_init();
+    fpu_cpu_init();
+
+    spin_lock(&kernel_lock);
+
+    cpu->started = 1;
+    kernel_log_info("smp: CPU %d started", cpu->id);
+
+    // Start the local tick and pick up the first process to run
+    apic_timer_periodic();
+    scheduler_run();
+
+    // The boot stack is not needed again
+    kernel_dispatch(cpu, NULL);
+}
+
+/**
+ * Starts all application processors
+ * Each started CPU receives its own idle process
+ */
+void smp_init(void) {
+    mp_config_t *config;
+    unsigned char *entry;
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        cpu_table[i].id = i;
+    }
+
+    cpu_table[0].started = 1;
+
+    if (!apic_enabled()) {
+        kernel_log_info("smp: APIC disabled, running on a single CPU");
+        return;
+    }
+
+    if (apic_id() != 0) {
+        kernel_log_warn("smp: bootstrap CPU has APIC id %d, running on a single CPU", apic_id());
+        return;
+    }
+
+    // The processors present are listed in the firmware's MP table
+    config = smp_mp_config();
+
+    if (!config) {
+        kernel_log_warn("smp: no MP configuration table, running on a single CPU");
+        return;
+    }
+
+    interrupts_irq_register(IRQ_RESCHED, isr_entry_resched, smp_resched_handler);
+
+    // Copy the trampoline to low memory, sharing this CPU's GDT and IDT
+    memcpy((void *)SMP_TRAMPOLINE_ADDR, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+    asm volatile("sgdt %0" : "=m"(*(smp_dtr_t *)(SMP_TRAMPOLINE_ADDR + (smp_trampoline_gdtr - smp_trampoline_start))));
+    asm volatile("sidt %0" : "=m"(smp_idtr));
+
+    entry = (unsigned char *)(config + 1);
+
+    for (int i = 0; i < config->count; entry += smp_mp_entry_size(entry), i++) {
+        mp_proc_t *proc = (mp_proc_t *)entry;
+
+        // Only processor entries are used here
+        if (proc->type != MP_ENTRY_PROC) {
+            continue;
+        }
+
+        if (!(proc->flags & MP_PROC_ENABLED) || (proc->flags & MP_PROC_BSP)) {
+            continue;
+        }
+
+        // Per-CPU data is indexed by local APIC id
+        if (proc->apic_id >= CPU_MAX) {
+            kernel_log_warn("smp: CPU with APIC id %d exceeds CPU_MAX (%d)", proc->apic_id, CPU_MAX);
+            continue;
+        }
+
+        smp_start_ap(proc->apic_id);
+    }
+
+    kernel_log_info("smp: %d CPU(s) running", smp_cpu_count);
+}
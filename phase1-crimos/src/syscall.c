@@ -115,6 +115,15 @@ int sys_get_time(void) {
     return _syscall0(SYSCALL_SYS_GET_TIME);
 }
 
+/**
+ * Gets the current system time (in nanoseconds)
+ * @param ns - pointer to where the time will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int sys_get_time_ns(unsigned long long *ns) {
+    return _syscall1(SYSCALL_SYS_GET_TIME_NS, (int)ns);
+}
+
 /**
  * Gets the operating system name
  * @param name - pointer to a character buffer where the name will be copied
@@ -124,6 +133,68 @@ int sys_get_name(char *name) {
     return _syscall1(SYSCALL_SYS_GET_NAME, (int)name);
 }
 
+/**
+ * Gets the keystroke-to-echo latency statistics
+ * @param stat - pointer to the structure where the statistics will be copied
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int sys_get_latency(latency_stat_t *stat) {
+    return _syscall1(SYSCALL_SYS_GET_LATENCY, (int)stat);
+}
+
+/**
+ * Gets the system load summary
+ * (1/5/15 second load averages, run queue depth, idle time, process entries)
+ * @param load - pointer to the structure where the summary will be copied
+ * @return 0 on success, -1 on error
+ */
+int sys_get_load(sys_load_t *load) {
+    return _syscall1(SYSCALL_SYS_GET_LOAD, (int)load);
+}
+
+/**
+ * Enables or disables a kernel log call site, or lists the call sites
+ * on the host console
+ * @param index - call site number, -1 for every call site
+ * @param enabled - 1 to enable, 0 to disable, -1 to list the call sites
+ * @return 0 on success, -1 if there is no such call site
+ */
+int sys_log_site(int index, int enabled) {
+    return _syscall2(SYSCALL_SYS_LOG_SITE, index, enabled);
+}
+
+/**
+ * Reads kernel log messages, formatted as text lines ("<seq> <level>: <message>")
+ * Pass the sequence number back in to continue where the last read ended
+ * @param seq - in: sequence number of the first message to read (0 for the
+ *              oldest message kept), out: sequence number to continue from
+ * @param buf - buffer to copy the messages to
+ * @param n - size of the buffer
+ * @return number of bytes copied, -1 on error
+ */
+int sys_log_read(unsigned int *seq, char *buf, int n) {
+    return _syscall3(SYSCALL_SYS_LOG_READ, (int)seq, (int)buf, n);
+}
+
+/**
+ * Obtains the statistics for an interrupt vector
+ * @param irq - interrupt vector
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 if the vector is invalid or has no handler
+ */
+int sys_irq_stat(int irq, irq_stat_t *stat) {
+    return _syscall2(SYSCALL_SYS_IRQ_STAT, irq, (int)stat);
+}
+
+/**
+ * Waits until kernel log messages are queued for printing
+ * Used by the kernel log process
+ * @return 0 on success, -1 on error
+ */
+int sys_log_wait(void) {
+    return _syscall0(SYSCALL_SYS_LOG_WAIT);
+}
+
 /**
  * Puts the current process to sleep for the specified number of seconds
  * @param seconds - number of seconds the process should sleep
@@ -132,6 +203,52 @@ void proc_sleep(int secs) {
     _syscall1(SYSCALL_PROC_SLEEP, secs);
 }
 
+/**
+ * Puts the current process to sleep for the specified number of milliseconds
+ * @param ms - number of milliseconds the process should sleep
+ * @return 0 on success, -1 on error
+ */
+int proc_sleep_ms(int ms) {
+    if (ms < 0) {
+        return -1;
+    }
+
+    return proc_sleep_ns(ms * 1000000ULL);
+}
+
+/**
+ * Puts the current process to sleep for the specified number of nanoseconds
+ * The process becomes runnable at the first timer tick at or after the time
+ * @param ns - number of nanoseconds the process should sleep
+ * @return 0 on success, -1 on error
+ */
+int proc_sleep_ns(unsigned long long ns) {
+    return _syscall2(SYSCALL_PROC_SLEEP_NS, (int)ns, (int)(ns >> 32));
+}
+
+/**
+ * Puts the current process to sleep until the system time reaches the
+ * specified time
+ * Advancing an absolute deadline (rather than sleeping for an interval)
+ * keeps periodic work from drifting
+ * @param ns - system time in nanoseconds (see sys_get_time_ns)
+ * @return 0 on success, -1 on error
+ */
+int proc_sleep_until(unsigned long long ns) {
+    return _syscall2(SYSCALL_PROC_SLEEP_UNTIL, (int)ns, (int)(ns >> 32));
+}
+
+/**
+ * Gets the accounting statistics of a process
+ * CPU time is measured in TSC cycles at every kernel entry and exit
+ * @param pid - process id
+ * @param stat - pointer to the statistics to fill in
+ * @return 0 on success, -1 if there is no such process
+ */
+int proc_stat(int pid, proc_stat_t *stat) {
+    return _syscall2(SYSCALL_PROC_STAT, pid, (int)stat);
+}
+
 /**
  * Exits the current process
  * @param exitcode An exit code to return to the parent process
@@ -141,6 +258,53 @@ void proc_exit(int exitcode) {
     _syscall1(SYSCALL_PROC_EXIT, exitcode);
 }
 
+/**
+ * Sets the current process' nice value
+ * @param nice - nice value (-20 highest to 19 lowest priority)
+ * @return 0 on success, -1 or other non-zero value on error
+ */
+int proc_set_nice(int nice) {
+    return _syscall1(SYSCALL_PROC_SET_NICE, nice);
+}
+
+/**
+ * Makes the current process a periodic real-time (EDF) process
+ * @param period_ms - period in milliseconds, 0 to return to the fair class
+ * @param budget_ms - execution budget per period in milliseconds
+ * @param deadline_ms - relative deadline in milliseconds, 0 to use the period
+ * @return 0 on success, -1 if the parameters are invalid or admission fails
+ */
+int proc_set_edf(int period_ms, int budget_ms, int deadline_ms) {
+    return _syscall3(SYSCALL_PROC_SET_EDF, period_ms, budget_ms, deadline_ms);
+}
+
+/**
+ * Ends the current job of a real-time process
+ * Sleeps until the start of the next period
+ */
+void proc_edf_wait(void) {
+    _syscall0(SYSCALL_PROC_EDF_WAIT);
+}
+
+/**
+ * Gives up the rest of the current process' time slice
+ * Other waiting processes run before the process is scheduled again
+ */
+void proc_yield(void) {
+    _syscall0(SYSCALL_PROC_YIELD);
+}
+
+/**
+ * Gives the rest of the current process' time slice to another process
+ * Useful when the current process waits on the target (e.g. a consumer
+ * waiting on its producer)
+ * @param pid - process id of the process to donate to
+ * @return 0 on success, -1 if there is no such process
+ */
+int proc_yield_to(int pid) {
+    return _syscall1(SYSCALL_PROC_YIELD_TO, pid);
+}
+
 /**
  * Gets the current process' id
  * @return process id
@@ -6,11 +6,51 @@
  * Timer Implementation
  */
 #include <spede/string.h>
+#include <spede/machine/io.h>
 
+#include "apic.h"
 #include "interrupts.h"
 #include "kernel.h"
+#include "profile.h"
 #include "queue.h"
+#include "scheduler.h"
+#include "smp.h"
 #include "timer.h"
+#include "tsc.h"
+
+// PIT Definitions
+#define PIT_FREQ            1193182     // PIT input clock frequency (Hz)
+#define PIT_PORT_CH0        0x40        // PIT channel 0 (system tick) data port
+#define PIT_PORT_CH2        0x42        // PIT channel 2 data port
+#define PIT_PORT_CMD        0x43        // PIT mode/command port
+#define PIT_PORT_GATE       0x61        // PIT channel 2 gate/speaker control
+
+#define PIT_CH2_GATE        0x01        // Gate input for channel 2
+#define PIT_CH2_SPEAKER     0x02        // Connects channel 2 to the speaker
+#define PIT_CH2_OUT         0x20        // Channel 2 output status
+
+#define PIT_CH0_ONESHOT     0x30        // Channel 0, lobyte/hibyte, mode 0 (one-shot)
+#define PIT_CH0_PERIODIC    0x34        // Channel 0, lobyte/hibyte, mode 2 (rate generator)
+
+// PIT counts per timer tick
+#define PIT_DIVISOR         ((PIT_FREQ + TIMER_HZ / 2) / TIMER_HZ)
+
+// The divisor is loaded into a 16-bit counter (TIMER_HZ of ~19 or more)
+#if PIT_DIVISOR > 0xffff || PIT_DIVISOR < 1
+#error "TIMER_HZ is out of range for the PIT"
+#endif
+
+// Longest one-shot the 16-bit PIT counter can be programmed for
+#define PIT_ONESHOT_MAX     (0xffff / PIT_DIVISOR)
+
+// Length of the TSC calibration window
+#define TSC_CALIBRATE_MS    10
+
+// Fixed point shift used for cycle to nanosecond conversion
+#define TSC_NS_SHIFT        24
+
+// Furthest tick that a kernel clock time is converted to
+#define TIMER_TICKS_AHEAD_MAX   0x3fffffff
 
 /**
  * Data structures
@@ -20,6 +60,7 @@ typedef struct timer_t {
     void (*callback)(); // Function to call when the interval occurs
     int interval;       // Interval in which the timer will be called
     int repeat;         // Indicate how many intervals to repeat (-1 should repeat forever)
+    int deferrable;     // Does not wake the CPU from tickless idle (see timer_callback_defer)
 } timer_t;
 
 /**
@@ -35,6 +76,25 @@ timer_t timers[TIMERS_MAX];
 // Timer allocator; used to allocate indexes into the timers table
 queue_t timer_allocator;
 
+// Calibrated TSC frequency (kHz)
+unsigned int tsc_khz;
+
+// Nanoseconds per TSC cycle, in TSC_NS_SHIFT fixed point
+unsigned int tsc_ns_mult;
+
+// TSC cycles per timer tick
+unsigned int tsc_per_tick;
+
+// TSC value when the last timer tick was processed
+unsigned long long timer_tick_tsc;
+
+// Number of ticks the PIT one-shot is programmed for (0 when periodic)
+int timer_oneshot_ticks;
+
+// Tickless idle statistics
+unsigned int timer_tickless_count;      // Times the periodic tick was stopped
+unsigned int timer_tickless_skipped;    // Ticks replayed after the tick was restarted
+
 
 /**
  * Registers a new callback to be called at the specified interval
@@ -53,6 +113,11 @@ int timer_callback_register(void (*func_ptr)(), int interval, int repeat) {
         return -1;
     }
 
+    if (interval <= 0) {
+        kernel_log_error("timer: invalid interval %d", interval);
+        return -1;
+    }
+
     // Obtain a timer id
     if (queue_out(&timer_allocator, &timer_id) != 0) {
         kernel_log_error("timer: unable to allocate a timer");
@@ -68,6 +133,24 @@ int timer_callback_register(void (*func_ptr)(), int interval, int repeat) {
     return timer_id;
 }
 
+/**
+ * Lets a callback wait while the CPU is idle
+ * The tickless idle does not wake up for it; it runs when the ticks
+ * skipped while idle are replayed
+ * @param id - timer id (as returned by timer_callback_register)
+ *
+ * @return 0 on success, -1 on error
+ */
+int timer_callback_defer(int id) {
+    if (id < 0 || id >= TIMERS_MAX || !timers[id].callback) {
+        kernel_log_error("timer: invalid callback id: %d", id);
+        return -1;
+    }
+
+    timers[id].deferrable = 1;
+    return 0;
+}
+
 /**
  * Unregisters the specified callback
  * @param id
@@ -103,7 +186,105 @@ int timer_get_ticks() {
 }
 
 /**
- * Timer IRQ Handler
+ * Converts a kernel clock time to the first timer tick at or after it
+ * Ticks are counted from the most recent one (timer_tick_tsc) rather than
+ * from the current time, so a process woken at the returned tick is never
+ * woken early
+ *
+ * @param ns - absolute kernel clock time in nanoseconds (see kernel_clock_ns)
+ * @return tick count (as returned by timer_get_ticks)
+ */
+int timer_ns_to_tick(unsigned long long ns) {
+    unsigned long long last;
+    unsigned long long delta;
+
+    // Kernel clock time of the most recent tick
+    last = kernel_clock_ns() - timer_cycles_to_ns(tsc_read() - timer_tick_tsc);
+
+    if (ns <= last) {
+        return timer_ticks;
+    }
+
+    // Round up to a whole tick
+    delta = ns - last + TIMER_NS_PER_TICK - 1;
+
+    if (delta >= (unsigned long long)TIMER_NS_PER_TICK * TIMER_TICKS_AHEAD_MAX) {
+        return timer_ticks + TIMER_TICKS_AHEAD_MAX;
+    }
+
+    return timer_ticks + tsc_div(delta, TIMER_NS_PER_TICK);
+}
+
+/**
+ * Returns the calibrated time stamp counter frequency
+ *
+ * @return TSC frequency in kHz, 0 if not calibrated
+ */
+unsigned int timer_get_tsc_khz(void) {
+    return tsc_khz;
+}
+
+/**
+ * Converts a number of TSC cycles to nanoseconds
+ * @param cycles - number of CPU cycles
+ *
+ * @return nanoseconds
+ */
+unsigned long long timer_cycles_to_ns(unsigned long long cycles) {
+    unsigned int hi = cycles >> 32;
+    unsigned int lo = cycles;
+
+    // Multiply each half separately so the product cannot overflow
+    return (((unsigned long long)hi * tsc_ns_mult) << (32 - TSC_NS_SHIFT))
+           + (((unsigned long long)lo * tsc_ns_mult) >> TSC_NS_SHIFT);
+}
+
+/**
+ * Calibrates the time stamp counter against the PIT
+ *
+ * PIT channel 2 is run as a one-shot for TSC_CALIBRATE_MS while the
+ * number of TSC cycles that elapse is counted. Channel 0 (the system
+ * tick) is not disturbed.
+ */
+void timer_tsc_calibrate(void) {
+    unsigned int count = PIT_FREQ * TSC_CALIBRATE_MS / 1000;
+    unsigned long long start;
+    unsigned long long cycles;
+
+    // Hold the channel 2 gate low (counting paused) with the speaker disconnected
+    outportb(PIT_PORT_GATE, inportb(PIT_PORT_GATE) & ~(PIT_CH2_SPEAKER | PIT_CH2_GATE));
+
+    // Channel 2, lobyte/hibyte access, mode 0 (interrupt on terminal count)
+    // Loading the count arms the one-shot; in mode 0 the gate only pauses it
+    outportb(PIT_PORT_CMD, 0xb0);
+    outportb(PIT_PORT_CH2, count & 0xff);
+    outportb(PIT_PORT_CH2, (count >> 8) & 0xff);
+
+    // Raising the gate lets the loaded count run down
+    outportb(PIT_PORT_GATE, inportb(PIT_PORT_GATE) | PIT_CH2_GATE);
+
+    start = tsc_read();
+    while ((inportb(PIT_PORT_GATE) & PIT_CH2_OUT) == 0);
+    cycles = tsc_read() - start;
+
+    tsc_khz = tsc_div(cycles, TSC_CALIBRATE_MS);
+
+    // The conversion factor only fits if the TSC runs faster than ~4MHz
+    // (at exactly the bound the quotient would be 2^32 and divl would fault)
+    if (cycles > (TSC_CALIBRATE_MS * 1000000ULL) >> (32 - TSC_NS_SHIFT)) {
+        tsc_ns_mult = tsc_div((TSC_CALIBRATE_MS * 1000000ULL) << TSC_NS_SHIFT, (unsigned int)cycles);
+    } else {
+        kernel_log_warn("timer: TSC too slow to calibrate (%u cycles)", (unsigned int)cycles);
+        tsc_ns_mult = 0;
+    }
+
+    tsc_per_tick = tsc_div((unsigned long long)tsc_khz * 1000, TIMER_HZ);
+
+    kernel_log_info("timer: TSC calibrated at %u kHz", tsc_khz);
+}
+
+/**
+ * Processes a single timer tick
  *
  * Should perform the following:
  *   - Increment the timer ticks every time the timer occurs
@@ -111,7 +292,7 @@ int timer_get_ticks() {
  *     - If the interval is hit, run the callback function
  *     - Handle timer repeats
  */
-void timer_irq_handler(void) {
+void timer_tick(void) {
     timer_t *timer;
 
     // Increment the timer_ticks value
@@ -126,6 +307,11 @@ void timer_irq_handler(void) {
             // If the timer interval is hit, run the callback function
             if (timer_ticks % timer->interval == 0) {
                 timer->callback();
+
+                // The callback may have unregistered its own timer
+                if (!timer->callback) {
+                    continue;
+                }
             }
 
             // If the timer repeat is greater than 0, decrement
@@ -141,6 +327,172 @@ void timer_irq_handler(void) {
     }
 }
 
+/**
+ * Programs PIT channel 0
+ * @param mode - PIT command selecting the counter mode
+ * @param count - PIT input clocks before the output fires
+ */
+void timer_pit_program(int mode, unsigned int count) {
+    outportb(PIT_PORT_CMD, mode);
+    outportb(PIT_PORT_CH0, count & 0xff);
+    outportb(PIT_PORT_CH0, (count >> 8) & 0xff);
+}
+
+/**
+ * Starts the periodic system tick on the active timer device
+ */
+void timer_hw_periodic(void) {
+    if (apic_enabled()) {
+        apic_timer_periodic();
+    } else {
+        timer_pit_program(PIT_CH0_PERIODIC, PIT_DIVISOR);
+    }
+}
+
+/**
+ * Arms the active timer device to fire once
+ * @param ticks - number of ticks until the timer fires
+ */
+void timer_hw_oneshot(int ticks) {
+    if (apic_enabled()) {
+        apic_timer_oneshot(ticks);
+    } else {
+        timer_pit_program(PIT_CH0_ONESHOT, ticks * PIT_DIVISOR);
+    }
+}
+
+/**
+ * Returns the number of ticks until the next timer callback is due
+ * Deferrable callbacks are left out
+ * @return ticks until the next callback, -1 if none are registered
+ */
+int timer_next_callback(void) {
+    int next = -1;
+
+    for (int i = 0; i < TIMERS_MAX; i++) {
+        timer_t *timer = &timers[i];
+
+        if (timer->callback && !timer->deferrable) {
+            int ticks = timer->interval - (timer_ticks % timer->interval);
+
+            if (next < 0 || ticks < next) {
+                next = ticks;
+            }
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Stops the periodic tick until the next deadline
+ *
+ * Reprograms the PIT in one-shot mode to fire when the next timer
+ * callback or the given deadline is due, whichever is sooner.
+ * Deferrable callbacks (such as the per-tick accounting) do not count;
+ * they run when timer_tickless_exit replays the skipped ticks.
+ * @param ticks - ticks until the next wakeup deadline (-1 for none)
+ */
+void timer_tickless_enter(int ticks) {
+    int next = timer_next_callback();
+    int max;
+
+    // Only the bootstrap CPU drives the system tick
+    if (!TIMER_TICKLESS || timer_oneshot_ticks || tsc_per_tick == 0 || smp_cpu()->id != 0) {
+        return;
+    }
+
+    if (ticks < 0 || (next >= 0 && next < ticks)) {
+        ticks = next;
+    }
+
+    // The PIT counter is only 16 bits; the local APIC timer is bounded to a second
+    max = apic_enabled() ? TIMER_HZ : PIT_ONESHOT_MAX;
+    if (ticks < 0 || ticks > max) {
+        ticks = max;
+    }
+
+    // Nothing to gain if the next tick is due anyway
+    if (ticks <= 1) {
+        return;
+    }
+
+    timer_hw_oneshot(ticks);
+    timer_oneshot_ticks = ticks;
+    timer_tickless_count++;
+}
+
+/**
+ * Restores the periodic tick after a tickless period
+ *
+ * Accounts for the ticks that elapsed while the periodic tick was
+ * stopped. Must be called on every kernel entry.
+ * @param irq - the interrupt that caused the kernel entry
+ */
+void timer_tickless_exit(int irq) {
+    unsigned long long elapsed;
+    int ticks;
+
+    if (!timer_oneshot_ticks || smp_cpu()->id != 0) {
+        return;
+    }
+
+    timer_hw_periodic();
+
+    // Round the elapsed time to the nearest tick
+    elapsed = tsc_read() - timer_tick_tsc + tsc_per_tick / 2;
+
+    if (elapsed >= (unsigned long long)tsc_per_tick * timer_oneshot_ticks) {
+        ticks = timer_oneshot_ticks;
+    } else {
+        ticks = tsc_div(elapsed, tsc_per_tick);
+    }
+
+    timer_oneshot_ticks = 0;
+
+    // The timer IRQ handler accounts for the tick that is being delivered
+    if (irq == IRQ_TIMER) {
+        ticks--;
+    }
+
+    if (ticks > 0) {
+        timer_tickless_skipped += ticks;
+    }
+
+    while (ticks-- > 0) {
+        timer_tick();
+    }
+
+    timer_tick_tsc = tsc_read();
+}
+
+/**
+ * Prints how often the periodic tick was stopped while idle
+ */
+void timer_dump(void) {
+    kernel_log_info("timer: tickless idle entered %u times, %u ticks skipped",
+                    timer_tickless_count, timer_tickless_skipped);
+}
+
+/**
+ * Timer IRQ Handler
+ */
+void timer_irq_handler(void) {
+    cpu_t *cpu = smp_cpu();
+
+    profile_sample(cpu->current);
+
+    // Other CPUs only account for the process they are running;
+    // the system tick and callbacks are driven by the bootstrap CPU
+    if (cpu->id != 0) {
+        scheduler_timer();
+        return;
+    }
+
+    timer_tick_tsc = tsc_read();
+    timer_tick();
+}
+
 /**
  * Initializes timer related data structures and variables
  */
@@ -150,6 +502,18 @@ void timer_init(void) {
     // Set the initial system time
     timer_ticks = 0;
 
+    // Calibrate the high resolution clock
+    timer_tsc_calibrate();
+
+    // Program the system tick for TIMER_HZ
+    if (apic_enabled()) {
+        apic_timer_init(tsc_per_tick);
+    }
+
+    timer_hw_periodic();
+    timer_oneshot_ticks = 0;
+    timer_tick_tsc = tsc_read();
+
     // Initialize the timers data structures
     memset(timers, 0, sizeof(timers));
 
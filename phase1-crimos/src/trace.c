@@ -0,0 +1,87 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * Scheduling Event Trace
+ *
+ * Each CPU records fixed-size binary events into its own ring, so
+ * recording needs no locking and costs a TSC read and a few stores.
+ * The rings are only decoded when dumped.
+ */
+#include <spede/stdio.h>
+
+#include "kernel.h"
+#include "smp.h"
+#include "trace.h"
+#include "tsc.h"
+
+// Trace rings, one per CPU
+trace_ring_t trace_rings[CPU_MAX];
+
+// Recording is paused while the rings are dumped
+int trace_enabled = 1;
+
+// Characters identifying each event type in a dump
+static const char trace_type_char[] = "?IOWSBCRQ";
+
+/**
+ * Records an event in the trace ring of the running CPU
+ * @param type - event type
+ * @param pid - process the event applies to, -1 if none
+ * @param arg - event specific argument
+ */
+void trace_event(trace_type_t type, int pid, unsigned int arg) {
+    trace_ring_t *ring;
+    trace_event_t *event;
+
+    if (!TRACE || !trace_enabled) {
+        return;
+    }
+
+    ring = &trace_rings[smp_cpu()->id];
+    event = &ring->events[ring->head++ & (TRACE_SIZE - 1)];
+
+    event->tsc = tsc_read();
+    event->type = type;
+    event->pid = pid;
+    event->arg = arg;
+}
+
+/**
+ * Prints the trace rings of every CPU to the host console, oldest first
+ * One line per event: "T <cpu> <tsc> <type> <pid> <arg>" (hexadecimal
+ * TSC and argument)
+ */
+void trace_dump(void) {
+    trace_enabled = 0;
+
+    for (int i = 0; i < CPU_MAX; i++) {
+        trace_ring_t *ring = &trace_rings[i];
+        unsigned int start = 0;
+
+        if (ring->head == 0) {
+            continue;
+        }
+
+        if (ring->head > TRACE_SIZE) {
+            start = ring->head - TRACE_SIZE;
+        }
+
+        kernel_log_info("trace: CPU %d events=%u dropped=%u", i, ring->head - start, start);
+
+        for (unsigned int n = start; n != ring->head; n++) {
+            trace_event_t *event = &ring->events[n & (TRACE_SIZE - 1)];
+            char type = '?';
+
+            if (event->type < sizeof(trace_type_char) - 1) {
+                type = trace_type_char[event->type];
+            }
+
+            printf("T %d %08x%08x %c %d %x\n", i,
+                   (unsigned int)(event->tsc >> 32), (unsigned int)event->tsc,
+                   type, event->pid, event->arg);
+        }
+    }
+
+    trace_enabled = 1;
+}
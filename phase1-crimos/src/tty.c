@@ -8,9 +8,13 @@
 
 #include <spede/string.h>
 
+#include "interrupts.h"
 #include "kernel.h"
+#include "kproc.h"
 #include "timer.h"
+#include "tsc.h"
 #include "tty.h"
+#include "uart.h"
 #include "vga.h"
 
 // TTY Table
@@ -19,6 +23,140 @@ struct tty_t tty_table[TTY_MAX];
 // Current Active TTY
 struct tty_t *active_tty;
 
+// Keystroke-to-echo latency histogram (in CPU cycles)
+unsigned int tty_latency_hist[TTY_LATENCY_BUCKETS];
+unsigned int tty_latency_count;
+unsigned int tty_latency_max;
+
+/**
+ * Translates a latency value to its histogram bucket
+ * @param cycles - latency in CPU cycles
+ * @return histogram bucket index
+ */
+static int tty_latency_bucket(unsigned int cycles) {
+    int msb;
+
+    if (cycles < (1 << TTY_LATENCY_SUB_BITS)) {
+        return cycles;
+    }
+
+    // Each power of two is split into equally sized sub-buckets
+    msb = 31 - __builtin_clz(cycles);
+
+    return ((msb - TTY_LATENCY_SUB_BITS + 1) << TTY_LATENCY_SUB_BITS)
+           | ((cycles >> (msb - TTY_LATENCY_SUB_BITS)) & ((1 << TTY_LATENCY_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the largest latency value that falls into the given bucket
+ * @param bucket - histogram bucket index
+ * @return latency in CPU cycles
+ */
+static unsigned int tty_latency_bucket_max(int bucket) {
+    int msb;
+    unsigned int low;
+
+    if (bucket < (1 << TTY_LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+
+    msb = (bucket >> TTY_LATENCY_SUB_BITS) + TTY_LATENCY_SUB_BITS - 1;
+    low = ((1 << TTY_LATENCY_SUB_BITS) | (bucket & ((1 << TTY_LATENCY_SUB_BITS) - 1)))
+          << (msb - TTY_LATENCY_SUB_BITS);
+
+    return low + ((1u << (msb - TTY_LATENCY_SUB_BITS)) - 1);
+}
+
+/**
+ * Finds the latency at the given percentile
+ * @param percent - percentile (1 to 100)
+ * @return latency in CPU cycles
+ */
+static unsigned int tty_latency_percentile(unsigned int percent) {
+    unsigned int rank;
+    unsigned int seen = 0;
+
+    if (tty_latency_count == 0) {
+        return 0;
+    }
+
+    // Computed in 64 bits: count * percent overflows after ~43 million keystrokes
+    rank = tsc_div((unsigned long long)tty_latency_count * percent + 99, 100);
+
+    for (int i = 0; i < TTY_LATENCY_BUCKETS; i++) {
+        seen += tty_latency_hist[i];
+
+        if (seen >= rank) {
+            unsigned int cycles = tty_latency_bucket_max(i);
+            return (cycles < tty_latency_max) ? cycles : tty_latency_max;
+        }
+    }
+
+    return tty_latency_max;
+}
+
+/**
+ * Records the echo latency for every keystroke pending on the TTY
+ * @param tty - pointer to the TTY that was just displayed
+ */
+static void tty_latency_record(struct tty_t *tty) {
+    unsigned long long now = tsc_read();
+
+    for (int i = 0; i < tty->input_pending; i++) {
+        unsigned long long delta = now - tty->input_tsc[i];
+        unsigned int cycles = (delta > 0xffffffffULL) ? 0xffffffff : (unsigned int)delta;
+
+        tty_latency_hist[tty_latency_bucket(cycles)]++;
+        tty_latency_count++;
+
+        if (cycles > tty_latency_max) {
+            tty_latency_max = cycles;
+        }
+    }
+
+    tty->input_pending = 0;
+}
+
+/**
+ * Obtains the keystroke-to-echo latency statistics
+ * @param stat - pointer to the structure to populate
+ * @return 0 on success, -1 on error
+ */
+int tty_latency_get(latency_stat_t *stat) {
+    if (!stat) {
+        return -1;
+    }
+
+    stat->count = tty_latency_count;
+    stat->p50 = tty_latency_percentile(50);
+    stat->p99 = tty_latency_percentile(99);
+    stat->max = tty_latency_max;
+
+    return 0;
+}
+
+/**
+ * Prints the keystroke-to-echo latency histogram to the host
+ */
+void tty_latency_dump(void) {
+    latency_stat_t stat;
+
+    tty_latency_get(&stat);
+
+    kernel_log_info("tty: keystroke latency count=%u p50=%u p99=%u max=%u cycles",
+                    stat.count, stat.p50, stat.p99, stat.max);
+    kernel_log_info("tty: keystroke latency p50=%u p99=%u max=%u us",
+                    tsc_div(timer_cycles_to_ns(stat.p50), 1000),
+                    tsc_div(timer_cycles_to_ns(stat.p99), 1000),
+                    tsc_div(timer_cycles_to_ns(stat.max), 1000));
+
+    for (int i = 0; i < TTY_LATENCY_BUCKETS; i++) {
+        if (tty_latency_hist[i]) {
+            kernel_log_info("tty:   <= %10u cycles: %u", tty_latency_bucket_max(i), tty_latency_hist[i]);
+        }
+    }
+}
+
 /**
  * Sets the active TTY to the selected TTY number
  * @param tty - TTY number
@@ -32,6 +170,9 @@ void tty_select(int n) {
     kernel_log_info("tty[%d]: selected", n);
 
     active_tty->refresh = 1;
+
+    // Keystrokes left on a hidden TTY would skew the echo latency
+    active_tty->input_pending = 0;
 }
 
 /**
@@ -58,6 +199,35 @@ struct tty_t *tty_get(int tty) {
     return NULL;
 }
 
+/**
+ * Sends a character to the serial port
+ * Line feeds are expanded to carriage return + line feed for terminals
+ * @param c - character to send
+ */
+static void tty_serial_putc(char c) {
+    if (c == '\n') {
+        uart_write("\r\n", 2);
+    } else {
+        uart_write(&c, 1);
+    }
+}
+
+/**
+ * Indicates if the tty has output to draw or send
+ * @return 1 if tty_refresh has work to do, 0 otherwise
+ */
+int tty_pending(void) {
+    if (!active_tty) {
+        return 0;
+    }
+
+    if (uart_present() && !ringbuf_is_empty(&tty_table[UART_TTY].io_output)) {
+        return 1;
+    }
+
+    return active_tty->refresh || !ringbuf_is_empty(&active_tty->io_output);
+}
+
 /**
  * Refreshes the tty if needed
  */
@@ -68,6 +238,17 @@ void tty_refresh(void) {
     }
 
     struct tty_t *tty = active_tty;
+    int echoed = 0;
+
+    // The serial TTY's output goes to the serial port even while hidden
+    if (uart_present() && tty->id != UART_TTY) {
+        struct tty_t *serial = &tty_table[UART_TTY];
+        char c;
+
+        while (ringbuf_read(&serial->io_output, &c) == 0) {
+            tty_serial_putc(c);
+        }
+    }
 
     // Handle new I/O (characters in the output buffer)
     // while not ringbuf_is_empty
@@ -77,6 +258,11 @@ void tty_refresh(void) {
         char c;
         ringbuf_read(&tty->io_output, &c);
         tty_update(c);
+        echoed = 1;
+
+        if (uart_present() && tty->id == UART_TTY) {
+            tty_serial_putc(c);
+        }
     }
 
 
@@ -86,6 +272,14 @@ void tty_refresh(void) {
 
         int x = 0;
         int y = 0;
+        int nested;
+
+        // The screen is about to be refreshed, so clear the refresh flag
+        // (a keystroke handled during the redraw sets it again)
+        tty->refresh = 0;
+
+        // Redrawing the screen is slow; let the keyboard interrupt it
+        nested = interrupts_nest_begin();
 
         for (int i = 0; i < TTY_WIDTH * TTY_HEIGHT; i++) {
             if (x >= VGA_WIDTH) {
@@ -96,8 +290,12 @@ void tty_refresh(void) {
             vga_putc_at(x++, y, tty->color_bg, tty->color_fg, tty->buf[tty->pos_scroll*TTY_WIDTH + i]);
         }
 
-        // The screen has been refreshed, so clea the refresh flag
-        tty->refresh = 0;
+        interrupts_nest_end(nested);
+    }
+
+    // Output following a keystroke is now on the screen
+    if (echoed && tty->input_pending) {
+        tty_latency_record(tty);
     }
 }
 
@@ -106,15 +304,39 @@ void tty_refresh(void) {
  * If the echo flag is set, will also write the character into the TTY
  * process output buffer
  * @param c - character to write into the input buffer
+ * @param tsc - time stamp counter value when the key was received
  */
-void tty_input(char c) {
+void tty_input(char c, unsigned long long tsc) {
     if (!active_tty) {
         return;
     }
 
     struct tty_t *tty = active_tty;
+    if (ringbuf_write(&tty->io_input, c) == 0 && tty->input_pending < TTY_LATENCY_PENDING) {
+        tty->input_tsc[tty->input_pending++] = tsc;
+    }
+
+    // Wake up any process waiting for input
+    kproc_wakeup(&tty->io_input);
+
+    if (tty->echo) {
+        ringbuf_write(&tty->io_output, c);
+    }
+}
+
+/**
+ * Write a character received on the serial port into the serial TTY
+ * input buffer, echoing it back out of the serial port if enabled
+ * @param c - character to write into the input buffer
+ */
+void tty_serial_input(char c) {
+    struct tty_t *tty = &tty_table[UART_TTY];
+
     ringbuf_write(&tty->io_input, c);
 
+    // Wake up any process waiting for input
+    kproc_wakeup(&tty->io_input);
+
     if (tty->echo) {
         ringbuf_write(&tty->io_output, c);
     }
@@ -193,6 +415,10 @@ void tty_init(void) {
 
     memset(tty_table, 0, sizeof(tty_table));
 
+    memset(tty_latency_hist, 0, sizeof(tty_latency_hist));
+    tty_latency_count = 0;
+    tty_latency_max = 0;
+
     for (int i = 0; i < TTY_MAX; i++) {
         tty_table[i].id=i;
         tty_table[i].color_bg = VGA_COLOR_BLACK;
@@ -204,6 +430,7 @@ void tty_init(void) {
     tty_select(0);
 
     // Update the screen on a regular interval (50 times per second right now)
-    timer_callback_register(tty_refresh, 2, -1);
+    // The tick is only stopped while there is nothing to draw (tty_pending)
+    timer_callback_defer(timer_callback_register(tty_refresh, TIMER_MS_TO_TICKS(20), -1));
 }
 
@@ -0,0 +1,263 @@
+/**
+ * CPE/CSC 159 - Operating System Pragmatics
+ * California State University, Sacramento
+ *
+ * 16550 UART (COM1) Driver
+ *
+ * Output is queued in a software transmit ring. The transmitter is
+ * kicked by filling its 16 byte FIFO; the "transmit holding register
+ * empty" interrupt then refills the FIFO in bursts until the ring is
+ * empty, so writers never wait on the line.
+ */
+#include <spede/machine/io.h>
+
+#include "interrupts.h"
+#include "kernel.h"
+#include "ringbuf.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "tty.h"
+#include "uart.h"
+
+// COM1 registers
+#define UART_PORT           0x3f8
+#define UART_DATA           (UART_PORT + 0)     // Receive/transmit buffer (DLAB=0)
+#define UART_IER            (UART_PORT + 1)     // Interrupt enable (DLAB=0)
+#define UART_DLL            (UART_PORT + 0)     // Divisor latch low (DLAB=1)
+#define UART_DLM            (UART_PORT + 1)     // Divisor latch high (DLAB=1)
+#define UART_IIR            (UART_PORT + 2)     // Interrupt identification (read)
+#define UART_FCR            (UART_PORT + 2)     // FIFO control (write)
+#define UART_LCR            (UART_PORT + 3)     // Line control
+#define UART_MCR            (UART_PORT + 4)     // Modem control
+#define UART_LSR            (UART_PORT + 5)     // Line status
+#define UART_SCR            (UART_PORT + 7)     // Scratch
+
+#define UART_IER_RX         0x01    // Received data available
+#define UART_IER_TX         0x02    // Transmit holding register empty
+
+#define UART_IIR_NONE       0x01    // No interrupt pending
+
+#define UART_FCR_ENABLE     0xc7    // Enable and clear the FIFOs, 14 byte receive trigger
+
+#define UART_LCR_8N1        0x03    // 8 data bits, no parity, 1 stop bit
+#define UART_LCR_DLAB       0x80    // Divisor latch access
+
+#define UART_MCR_ENABLE     0x0b    // DTR, RTS and OUT2 (connects the IRQ line)
+
+#define UART_LSR_DR         0x01    // Data ready
+#define UART_LSR_OE         0x02    // Overrun error
+#define UART_LSR_THRE       0x20    // Transmit holding register empty
+
+#define UART_FIFO_SIZE      16      // Transmit FIFO depth
+#define UART_RX_BURST       64      // Bytes received per interrupt
+#define UART_CLOCK          115200  // Divisor 1 rate
+
+// Indicates if COM1 is present and initialized
+int uart_enabled = 0;
+
+// Transmit ring and the lock protecting it (taken with interrupts off)
+ringbuf_t uart_tx;
+spinlock_t uart_lock;
+
+// Transmit holding register empty interrupt is enabled
+int uart_tx_armed = 0;
+
+// Received bytes not yet passed to the serial TTY (see uart_rx_deliver)
+char uart_rx[UART_RX_BURST];
+int uart_rx_len = 0;
+
+// Statistics
+unsigned int uart_tx_bytes = 0;     // Bytes sent
+unsigned int uart_tx_dropped = 0;   // Bytes dropped because the ring was full
+unsigned int uart_rx_bytes = 0;     // Bytes received
+unsigned int uart_rx_overruns = 0;  // Receive FIFO overruns
+
+/**
+ * Disables interrupts on the running CPU and takes the UART lock
+ * @return the previous EFLAGS value
+ */
+static unsigned int uart_lock_irqsave(void) {
+    unsigned int flags;
+
+    asm volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    spin_lock(&uart_lock);
+
+    return flags;
+}
+
+/**
+ * Releases the UART lock and restores the interrupt flag
+ * @param flags - EFLAGS value returned by uart_lock_irqsave
+ */
+static void uart_unlock_irqrestore(unsigned int flags) {
+    spin_unlock(&uart_lock);
+    asm volatile("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/**
+ * Moves up to a FIFO's worth of bytes from the transmit ring to the UART
+ * Enables the transmit interrupt while bytes remain; the UART lock must be held
+ */
+static void uart_tx_fill(void) {
+    char c;
+
+    // The FIFO can only be filled once it is empty. If it is still
+    // sending, the transmit interrupt (armed below) refills it when done
+    if (inportb(UART_LSR) & UART_LSR_THRE) {
+        for (int i = 0; i < UART_FIFO_SIZE && ringbuf_read(&uart_tx, &c) == 0; i++) {
+            outportb(UART_DATA, c);
+            uart_tx_bytes++;
+        }
+    }
+
+    if (ringbuf_is_empty(&uart_tx)) {
+        if (uart_tx_armed) {
+            outportb(UART_IER, UART_IER_RX);
+            uart_tx_armed = 0;
+        }
+    } else if (!uart_tx_armed) {
+        outportb(UART_IER, UART_IER_RX | UART_IER_TX);
+        uart_tx_armed = 1;
+    }
+}
+
+/**
+ * Queues bytes for transmission on COM1
+ * Never waits: bytes that do not fit in the transmit ring are dropped
+ * @param buf - bytes to send
+ * @param n - number of bytes
+ * @return number of bytes queued, -1 if COM1 is not present
+ */
+int uart_write(char *buf, int n) {
+    unsigned int flags;
+    int queued = 0;
+
+    if (!uart_enabled || !buf) {
+        return -1;
+    }
+
+    flags = uart_lock_irqsave();
+
+    while (queued < n && ringbuf_write(&uart_tx, buf[queued]) == 0) {
+        queued++;
+    }
+
+    uart_tx_dropped += n - queued;
+
+    // Start the transmitter if it is idle
+    if (!uart_tx_armed) {
+        uart_tx_fill();
+    }
+
+    uart_unlock_irqrestore(flags);
+
+    return queued;
+}
+
+/**
+ * Passes the received bytes to the serial TTY
+ * Runs without the UART lock held: waking a reader may log to the UART
+ */
+static void uart_rx_deliver(void) {
+    for (int i = 0; i < uart_rx_len; i++) {
+        // Terminals send a carriage return for the enter key
+        tty_serial_input(uart_rx[i] == '\r' ? '\n' : uart_rx[i]);
+    }
+
+    uart_rx_len = 0;
+}
+
+/**
+ * COM1 IRQ handler
+ * Passes received bytes to the serial TTY and refills the transmit FIFO
+ * Nested in another handler, the bytes are delivered once the interrupted
+ * section ends, since delivering wakes processes
+ */
+void uart_irq_handler(void) {
+    unsigned int flags;
+
+    flags = uart_lock_irqsave();
+
+    while (!(inportb(UART_IIR) & UART_IIR_NONE)) {
+        int lsr = inportb(UART_LSR);
+
+        if (lsr & UART_LSR_OE) {
+            uart_rx_overruns++;
+        }
+
+        // Drain the receive FIFO
+        while (lsr & UART_LSR_DR) {
+            char c = inportb(UART_DATA);
+
+            if (uart_rx_len < UART_RX_BURST) {
+                uart_rx[uart_rx_len++] = c;
+                uart_rx_bytes++;
+            } else {
+                uart_rx_overruns++;
+            }
+
+            lsr = inportb(UART_LSR);
+        }
+
+        uart_tx_fill();
+    }
+
+    uart_unlock_irqrestore(flags);
+
+    if (smp_cpu()->irq_depth > 0) {
+        interrupts_defer(uart_rx_deliver);
+    } else {
+        uart_rx_deliver();
+    }
+}
+
+/**
+ * Indicates if COM1 is present and initialized
+ * @return 1 if present, 0 otherwise
+ */
+int uart_present(void) {
+    return uart_enabled;
+}
+
+/**
+ * Initializes COM1 for interrupt driven transmit and receive
+ * Does nothing if the driver is not built or no UART is present
+ */
+void uart_init(void) {
+    int divisor = UART_CLOCK / UART_BAUD;
+
+    if (!UART) {
+        return;
+    }
+
+    // A missing UART reads back all ones
+    outportb(UART_SCR, 0x5a);
+
+    if (inportb(UART_SCR) != 0x5a) {
+        kernel_log_warn("uart: COM1 not present");
+        return;
+    }
+
+    kernel_log_info("uart: Initializing COM1 at %d baud", UART_BAUD);
+
+    ringbuf_init(&uart_tx);
+
+    outportb(UART_IER, 0);
+    outportb(UART_LCR, UART_LCR_DLAB);
+    outportb(UART_DLL, divisor & 0xff);
+    outportb(UART_DLM, (divisor >> 8) & 0xff);
+    outportb(UART_LCR, UART_LCR_8N1);
+    outportb(UART_FCR, UART_FCR_ENABLE);
+    outportb(UART_MCR, UART_MCR_ENABLE);
+
+    // Discard anything left in the receiver
+    while (inportb(UART_LSR) & UART_LSR_DR) {
+        inportb(UART_DATA);
+    }
+
+    uart_tx_armed = 0;
+    uart_enabled = 1;
+
+    interrupts_irq_register(IRQ_COM1, isr_entry_com1, uart_irq_handler);
+    outportb(UART_IER, UART_IER_RX);
+}